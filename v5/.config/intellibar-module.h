@@ -0,0 +1,91 @@
+// intellibar-module.h
+// C ABI for intellibar collectors built as shared objects and loaded with --plugin FILE
+// - A plugin exports one `const struct intellibar_module intellibar_module`
+// - It declares its field name, default format, interval, output width and the fds it wants polled
+// - Its callbacks run on intellibar's own reactor and worker pool: no thread per plugin
+// - Text is written straight into the field's double buffer and published by a generation bump: no locks, no copies
+//
+//   cc -shared -fPIC -O2 gpu.c -o gpu.so
+//   intellibar --plugin ./gpu.so        (then "modules = ... gpu" in the config)
+
+#ifndef INTELLIBAR_MODULE_H
+#define INTELLIBAR_MODULE_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* bumped on any incompatible change below; intellibar refuses other versions */
+#define INTELLIBAR_MODULE_ABI 2
+
+/* longest text a field holds, NUL included */
+#define INTELLIBAR_TEXT 128
+
+/* the most descriptors one plugin may have polled */
+#define INTELLIBAR_MAX_FDS 4
+
+/* what a callback returns: the field's level (colours the --json block),
+   a failure (the field keeps its last text, marked stale), or from ready()
+   that nothing changed */
+#define INTELLIBAR_OK 0
+#define INTELLIBAR_WARN 1
+#define INTELLIBAR_CRIT 2
+#define INTELLIBAR_FAIL (-1)
+#define INTELLIBAR_KEEP (-2)
+
+/* single-writer double buffer: the writer fills the back text and bumps gen,
+   the bar copies the front text and retries if gen moved underneath it */
+struct intellibar_slot {
+    unsigned gen;
+    int rc[2];
+    char text[2][INTELLIBAR_TEXT];
+};
+
+/* the text to fill before the next publish */
+static inline char *intellibar_back(struct intellibar_slot *s) {
+    return s->text[(__atomic_load_n(&s->gen, __ATOMIC_RELAXED) + 1) & 1];
+}
+
+/* handed to init(); valid until exit. The slot has exactly one writer: a
+   plugin with collect() leaves it to the bar's workers, gets slot NULL and a
+   publish that refuses; only a plugin without collect() fills the back text
+   and publishes, from its own thread */
+struct intellibar_host {
+    unsigned abi;
+    struct intellibar_slot *slot;
+    /* make the back text current and wake the bar, from any one thread at a
+       time. Returns 0, or -1 when the plugin has a collect() */
+    int (*publish)(const struct intellibar_host *host, int level);
+};
+
+struct intellibar_module {
+    unsigned abi;               /* INTELLIBAR_MODULE_ABI */
+    const char *name;           /* field name in `modules =`, `interval.NAME`, `format.NAME` */
+    const char *format;         /* default format around the text, NULL = "%s" */
+    int interval;               /* seconds between collect() calls, 0 = only when shown, clicked or an fd fires */
+    int width;                  /* columns the text is padded or cut to, 0 = as produced */
+
+    /* once at startup, on the reactor thread: store up to max descriptors to
+       poll in fds[] and return how many, or -1 to fail the load (the library
+       is not unloaded after init has run). The field shows N/A until the
+       first text arrives */
+    int (*init)(const struct intellibar_host *host, int *fds, int max);
+
+    /* on a worker every interval (on the reactor when interval is 0): write
+       the text into out, at most len bytes with the NUL, and return a level
+       or INTELLIBAR_FAIL. out is the slot's back buffer. NULL = none */
+    int (*collect)(char *out, size_t len);
+
+    /* on the reactor thread when one of the fds is ready: drain it, then
+       either fill out and return a level as collect() does, or return
+       INTELLIBAR_KEEP. NULL = none */
+    int (*ready)(int fd, unsigned events, char *out, size_t len);
+};
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -1,10 +1,21 @@
 // intellibar.cpp
 // Fully featured, ultra-lean swaybar status command
 // - Fixed-width fields for stable layout
-// - EINTR-safe file reads
-// - Robust sway IPC (partial I/O + little-endian packing)
+// - EINTR-safe file reads via persistent descriptors and pread
+// - Persistent sway IPC connection subscribed to input events; replies streamed through a fixed-size JSON scanner
 // - Persistent PulseAudio connection using pa_threaded_mainloop
-// - Default sink resolution, short cache, and timeouts
+// - Default sink resolution and volume pushed via sink/server change events
+// - epoll reactor, one timerfd per collector, writes only on change as one writev of precompiled fragments
+// - Collectors that can block (statvfs, plugins) run on an on-demand worker pool with deadlines; late fields go stale
+// - Sampling governor: intervals stretch on battery, when idle/locked and while values are stable
+// - Rolling history per metric: sparklines for RAM/CPU/download, smoothed net rate
+// - RAM from a single-pass meminfo table (swap/cache/dirty/shmem on request), PSI stall shares and trigger
+// - Optional top-N processes from cached per-pid fds, a bounded heap and a CPU budget
+// - Optional Wi-Fi SSID/signal/bitrate over a persistent nl80211 socket, re-read on connect/disconnect/roam events
+// - Collectors loadable as shared objects (--plugin, C ABI in intellibar-module.h), publishing lock-free
+// - --record/--replay: collector inputs logged to a file and fed back through the same parsers, output checked
+// - Optional swaybar JSON protocol with threshold colours and click events
+// - ~/.config/intellibar/config picks fields, order, intervals and formats; reloaded on change
 
 #include <unistd.h>
 #include <fcntl.h>
@@ -12,47 +23,464 @@
 #include <time.h>
 #include <pthread.h>
 #include <sys/types.h>
-#include <sys/stat.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <errno.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/resource.h>
+#include <sys/inotify.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <signal.h>
+#include <dirent.h>
+#include <dlfcn.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/if_link.h>
+#include <linux/genetlink.h>
+#include <linux/nl80211.h>
+#include <net/if.h>
 
 #include <pulse/pulseaudio.h>
 
-#define STATS_INTERVAL 2
-#define NET_IFACE "wlp59s0"
+#include "intellibar-module.h"
 
-struct StatusData {
-    char line[512];
-    pthread_mutex_t mtx;
-} shared_data;
+#define STATS_INTERVAL 2
+/* interface to measure; empty follows whichever link carries the default route */
+#define NET_IFACE ""
+/* hwmon sensor to show: a label ("Package id 0"), a chip ("k10temp") or
+   "chip/label"; empty means the hottest of all sensors */
+#define TEMP_SENSOR ""
+/* mount points for the Disk field ("all" = every block-device filesystem),
+   whether to add their read/write throughput, and the battery to show
+   (empty = all of them combined) */
+#define DISK_MOUNT "/"
+#define DISK_IO 0
+#define BATTERY ""
+/* CPU field: CPU_SHOW_TOTAL, CPU_SHOW_MAXCORE (plus busiest core),
+   CPU_SHOW_CORES (plus per-core sparkline) or CPU_SHOW_IOWAIT (plus iowait share);
+   the config's "cpu = total|maxcore|cores|iowait" */
+#define CPU_MODE CPU_SHOW_TOTAL
+/* RAM field extras after used/total: 0 or any of MEM_SWAP | MEM_CACHED | MEM_DIRTY | MEM_SHMEM */
+#define MEM_EXTRA 0
+/* append the PSI stall share (some avg10) to the RAM and CPU fields; the
+   trigger re-reads RAM as soon as memory stalls pass it, instead of at the
+   next tick ("some|full <stall us> <window us>", "" = off) */
+#define PSI 0
+#define PSI_TRIGGER "some 150000 2000000"
+/* the opt-in Top field: the TOP_COUNT (1-3) biggest processes by CPU or,
+   with TOP_BY_MEM 1, by resident memory */
+#define TOP_COUNT 3
+#define TOP_BY_MEM 0
+/* sampling governor: periodic fields are sampled less often while on
+   battery, while the session is idle or locked and while their text does
+   not change; activity or a change brings the configured rate back */
+#define GOVERNOR 1
+/* history sparkline appended to the RAM, CPU and download fields; 0 disables */
+#define SPARK_WIDTH 8
+/* weight of the newest sample in the displayed network rate (1.0 = raw) */
+#define NET_EWMA_ALPHA 0.5
+/* --json colour thresholds, as in the old i3blocks cpu_usage2/bandwidth2
+   helpers: warning shows orange, critical red; 0 disables */
+#define CPU_WARN 50
+#define CPU_CRIT 80
+#define NET_WARN_KIB 0
+#define NET_CRIT_KIB 0
+#define PSI_WARN 10
+#define PSI_CRIT 40
+/* Wi-Fi signal (dBm) below which the opt-in wifi field warns and goes critical */
+#define WIFI_WARN_DBM -70
+#define WIFI_CRIT_DBM -80
 
 /* ---------- small helpers ---------- */
 
-static void read_file(const char *path, char *buf, size_t buflen) {
-    int fd = open(path, O_RDONLY);
-    if (fd < 0) { buf[0] = '\0'; return; }
+/* direct syscalls issued by intellibar itself, sampled per reactor wakeup with --trace */
+static struct {
+    unsigned long syscalls;
+    unsigned long ticks;            /* reactor wakeups: epoll_wait returns */
+    unsigned long jobs;             /* collector runs handed to the worker pool */
+    unsigned long worker_wakeups;   /* workers started or woken for a job */
+    int trace;
+} io_stats = { 0, 0, 0, 0, 0 };
+
+/* runtime counters, dumped on SIGUSR1 or over the stats socket */
+static struct {
+    unsigned long syscalls_total;
+    unsigned long src_hits, src_opens, src_reopens;
+    unsigned long hwmon_rescans, psi_triggers;
+    unsigned long rtnl_errors;
+    unsigned long genl_errors, wifi_events;
+    unsigned long sway_connects, sway_failures, sway_events;
+    unsigned long pa_connects, pa_failures, pa_updates;
+    unsigned long lines;
+    unsigned long blocks_built, clicks, config_loads;
+    unsigned long top_scans, top_skips;
+} self_stats;
+
+static inline void stat_inc(unsigned long *c) {
+    __atomic_fetch_add(c, 1, __ATOMIC_RELAXED);
+}
+
+static inline void count_syscalls(unsigned long n) {
+    __atomic_fetch_add(&io_stats.syscalls, n, __ATOMIC_RELAXED);
+}
+
+/* every time some thread of the bar was woken: the reactor and the workers */
+static inline unsigned long wakeups_total(void) {
+    return io_stats.ticks + __atomic_load_n(&io_stats.worker_wakeups, __ATOMIC_RELAXED);
+}
+
+/* flags raised by the reactor and consumed by collectors running on workers */
+static inline void flag_raise(int *f) {
+    __atomic_store_n(f, 1, __ATOMIC_RELEASE);
+}
+
+/* what a collector took is part of its recorded input (record and replay) */
+static int tape_flag(int raised);
+
+static inline int flag_take(int *f) {
+    return tape_flag(__atomic_exchange_n(f, 0, __ATOMIC_ACQUIRE));
+}
+
+/* settings the collectors read on worker threads. The defaults are the macros
+   above; config_load replaces them from the reactor under the lock, workers
+   copy out what they need (see the config section) */
+#define CFG_STR 64
+
+enum { CPU_SHOW_TOTAL, CPU_SHOW_MAXCORE, CPU_SHOW_CORES, CPU_SHOW_IOWAIT };
+
+static struct {
+    pthread_mutex_t lock;
+    char net_iface[CFG_STR];
+    char temp_sensor[CFG_STR];
+    char disk[CFG_STR];
+    int disk_io;
+    char battery[CFG_STR];
+    int cpu_mode;
+    int mem_extra;
+    int psi;
+    int top_count, top_by_mem;
+} cfg = { PTHREAD_MUTEX_INITIALIZER, NET_IFACE, TEMP_SENSOR, DISK_MOUNT, DISK_IO, BATTERY, CPU_MODE, MEM_EXTRA, PSI,
+          TOP_COUNT, TOP_BY_MEM };
+
+static void cfg_get(char *out, size_t outlen, const char *field) {
+    pthread_mutex_lock(&cfg.lock);
+    snprintf(out, outlen, "%s", field);
+    pthread_mutex_unlock(&cfg.lock);
+}
+
+/* strlcpy: copy what fits and return the copied length */
+static size_t str_copy(char *dst, size_t dstlen, const char *src) {
+    size_t n = strnlen(src, dstlen - 1);
+    memcpy(dst, src, n);
+    dst[n] = '\0';
+    return n;
+}
+
+/* the per-tick fields are built with these instead of snprintf: literals
+   are copied and numbers right-aligned to a fixed width by a small itoa.
+   Output is cut at cap rather than overflowing */
+struct text {
+    char *buf;
+    size_t len, cap;
+};
+
+#define TEXT(out, outlen) { (out), 0, (outlen) }
+
+static void text_str(struct text *t, const char *s) {
+    size_t n = strlen(s);
+    if (n > t->cap - 1 - t->len) n = t->cap - 1 - t->len;
+    memcpy(t->buf + t->len, s, n);
+    t->len += n;
+}
+
+static void text_num(struct text *t, long long v, int width) {
+    char digits[24];
+    int n = 0;
+    unsigned long long u = v < 0 ? 0ULL - (unsigned long long)v : (unsigned long long)v;
+    do {
+        digits[n++] = (char)('0' + u % 10);
+        u /= 10;
+    } while (u);
+    if (v < 0) digits[n++] = '-';
+    for (; width > n && t->len + 1 < t->cap; --width) t->buf[t->len++] = ' ';
+    while (n && t->len + 1 < t->cap) t->buf[t->len++] = digits[--n];
+}
+
+static size_t text_end(struct text *t) {
+    t->buf[t->len] = '\0';
+    return t->len;
+}
+
+/* longest text a collector produces */
+#define FIELD_LEN INTELLIBAR_TEXT
+
+/* the worker -> reactor handoff is the plugin ABI's struct intellibar_slot:
+   the writer fills intellibar_back() and commits, readers copy the front
+   text and retry if gen moved underneath them */
+static void pub_commit(struct intellibar_slot *p, int rc) {
+    unsigned g = __atomic_load_n(&p->gen, __ATOMIC_RELAXED);
+    p->rc[(g + 1) & 1] = rc;
+    __atomic_store_n(&p->gen, g + 1, __ATOMIC_RELEASE);
+}
+
+static void pub_write(struct intellibar_slot *p, int rc, const char *text) {
+    str_copy(intellibar_back(p), FIELD_LEN, text);
+    pub_commit(p, rc);
+}
+
+static unsigned pub_read(struct intellibar_slot *p, int *rc, char *out, size_t outlen) {
+    for (;;) {
+        unsigned g = __atomic_load_n(&p->gen, __ATOMIC_ACQUIRE);
+        unsigned front = g & 1;
+        if (rc) *rc = p->rc[front];
+        str_copy(out, outlen, p->text[front]);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&p->gen, __ATOMIC_RELAXED) == g) return g;
+    }
+}
+
+/* ---------- record and replay ---------- */
+
+/* --record FILE logs every collector run as a frame: each input it took in
+   (file contents, directory listings, clocks, the flags it consumed, the
+   parsed netlink and statvfs results, top's process reads) in the order it
+   asked for them, then the text it produced; the sway socket's bytes are
+   logged as they arrive. --replay FILE runs the same collectors again with
+   each input answered from the frame instead of the system, as fast as they
+   go, and checks the text comes out byte for byte the same */
+#define TAPE_MAGIC "intellibar-tape 1\n"
+#define TAPE_FRAME_MAX (1024 * 1024)     /* a top walk logs every process it reads */
+#define TAPE_FD 0x7fffffff      /* what a replayed source holds instead of a descriptor */
+
+/* an input in a frame: this header, the name and its NUL, then len bytes */
+struct tape_in {
+    int64_t result;
+    uint32_t len;
+};
+
+struct tape_frame {
+    char *buf;
+    size_t len;
+    size_t pos;                 /* replay: next input */
+    int bad;                    /* record: outgrew the buffer; replay: asked for something else */
+};
+
+static struct {
+    int fd;                     /* --record output, -1 when not recording */
+    int replay;
+    pthread_mutex_t lock;
+} tape = { -1, 0, PTHREAD_MUTEX_INITIALIZER };
+
+/* the frame of the collector running on this thread, NULL everywhere else
+   (the reactor's own reads are neither recorded nor replayed) */
+static __thread struct tape_frame *tape_cur;
+
+static inline int tape_replaying(void) {
+    return tape_cur && tape.replay;
+}
+
+/* record: append one input to the running frame */
+static void tape_put(const char *name, long long result, const void *data, size_t len) {
+    struct tape_frame *f = tape_cur;
+    if (!f || f->bad) return;
+    struct tape_in in = { result, (uint32_t)len };
+    size_t nlen = strlen(name) + 1;
+    if (f->len + sizeof(in) + nlen + len > TAPE_FRAME_MAX) {
+        f->bad = 1;
+        return;
+    }
+    memcpy(f->buf + f->len, &in, sizeof(in));
+    memcpy(f->buf + f->len + sizeof(in), name, nlen);
+    if (len) memcpy(f->buf + f->len + sizeof(in) + nlen, data, len);
+    f->len += sizeof(in) + nlen + len;
+}
+
+/* replay: the next input of the frame, which has to be `name`; up to buflen
+   bytes of its data land in buf. -1 from the first mismatch on */
+static long long tape_get(const char *name, void *buf, size_t buflen) {
+    struct tape_frame *f = tape_cur;
+    struct tape_in in;
+    size_t nlen = strlen(name) + 1;
+    if (!f->bad && f->pos + sizeof(in) + nlen <= f->len) {
+        memcpy(&in, f->buf + f->pos, sizeof(in));
+        const char *p = f->buf + f->pos + sizeof(in);
+        if (memcmp(p, name, nlen) == 0 && in.len <= f->len - f->pos - sizeof(in) - nlen) {
+            memcpy(buf, p + nlen, in.len < buflen ? in.len : buflen);
+            f->pos += sizeof(in) + nlen + in.len;
+            return in.result;
+        }
+    }
+    f->bad = 1;
+    return -1;
+}
+
+/* a value the collector computed from the system: recorded as is, or
+   overwritten with the recorded one */
+static void tape_value(const char *name, void *v, size_t len) {
+    if (tape_replaying()) tape_get(name, v, len);
+    else tape_put(name, 0, v, len);
+}
+
+static int tape_flag(int raised) {
+    if (tape_cur) tape_value("flag", &raised, sizeof(raised));
+    return raised;
+}
+
+/* the file is TAPE_MAGIC and then records, each this header and len bytes:
+   TAPE_RUN     the collector's text and its NUL, then its frame
+   TAPE_CLOCK   the time_t the clock field was formatted from
+   TAPE_CONFIG  the config file text and its NUL
+   TAPE_SWAY    bytes read from the sway socket, up to a message end at most;
+                none when the connection was lost */
+enum { TAPE_RUN, TAPE_CLOCK, TAPE_CONFIG, TAPE_SWAY };
+
+struct tape_rec {
+    uint32_t len;
+    uint8_t kind, module;
+    int16_t rc;
+};
+
+static void write_all(int fd, const char *buf, size_t len);
+
+/* records come from the reactor and every worker: one at a time */
+static void tape_emit(int kind, int module, int rc, const void *a, size_t alen, const void *b, size_t blen) {
+    struct tape_rec r = { (uint32_t)(alen + blen), (uint8_t)kind, (uint8_t)module, (int16_t)rc };
+    pthread_mutex_lock(&tape.lock);
+    write_all(tape.fd, (const char *)&r, sizeof(r));
+    write_all(tape.fd, (const char *)a, alen);
+    if (blen) write_all(tape.fd, (const char *)b, blen);
+    pthread_mutex_unlock(&tape.lock);
+}
+
+/* ---------- sources ---------- */
+
+/* a /proc or /sys file opened once and re-read from offset 0 on every sample */
+struct source {
+    const char *path;
+    int fd;
+};
+
+#define SOURCE(p) { (p), -1 }
+
+static void source_close(struct source *s) {
+    if (s->fd >= 0 && s->fd != TAPE_FD) {
+        close(s->fd);
+        count_syscalls(1);
+    }
+    s->fd = -1;
+}
+
+/* --root: read /proc and /sys from a fixture tree instead (used by --bench) */
+static const char *sys_root = "";
+
+static const char *rooted(const char *path, char *buf, size_t buflen) {
+    if (!sys_root[0]) return path;
+    snprintf(buf, buflen, "%s%s", sys_root, path);
+    return buf;
+}
+
+static int source_open_path(struct source *s) {
+    char full[512];
+    s->fd = open(rooted(s->path, full, sizeof(full)), O_RDONLY | O_CLOEXEC);
+    count_syscalls(1);
+    stat_inc(&self_stats.src_opens);
+    return s->fd;
+}
+
+static int source_open(struct source *s) {
+    if (tape_replaying()) {
+        char unused;
+        s->fd = tape_get(s->path, &unused, 0) < 0 ? -1 : TAPE_FD;
+        return s->fd;
+    }
+    source_open_path(s);
+    tape_put(s->path, s->fd, NULL, 0);
+    return s->fd;
+}
+
+/* EINTR-safe pread of the whole file into buf; the descriptor is reopened once
+   when the underlying device went away (hwmon/power_supply re-registered after
+   suspend). Returns bytes read or -1 with buf set to "" */
+static ssize_t source_pread(struct source *s, char *buf, size_t buflen) {
+    buf[0] = '\0';
+    if (s->fd >= 0) stat_inc(&self_stats.src_hits);
+    for (int attempt = 0; attempt < 2; ++attempt) {
+        if (attempt) stat_inc(&self_stats.src_reopens);
+        if (s->fd < 0 && source_open_path(s) < 0) return -1;
+
+        size_t off = 0;
+        int err = 0;
+        while (off + 1 < buflen) {
+            ssize_t n = pread(s->fd, buf + off, buflen - 1 - off, (off_t)off);
+            count_syscalls(1);
+            if (n > 0) {
+                off += (size_t)n;
+                continue;
+            } else if (n == 0) {
+                break;
+            } else {
+                if (errno == EINTR) continue;
+                err = errno;
+                break;
+            }
+        }
+        buf[off] = '\0';
+        if (err == 0 || off > 0) return (ssize_t)off;
+
+        source_close(s);
+        if (err != ENODEV && err != ESTALE && err != EBADF && err != ENOENT) return -1;
+    }
+    return -1;
+}
+
+/* source_pread, taped: under --replay the recorded bytes come back instead */
+static ssize_t source_read(struct source *s, char *buf, size_t buflen) {
+    if (tape_replaying()) {
+        long long n = tape_get(s->path, buf, buflen - 1);
+        if (n >= (long long)buflen) n = (long long)buflen - 1;
+        buf[n > 0 ? n : 0] = '\0';
+        s->fd = n < 0 ? -1 : TAPE_FD;
+        return (ssize_t)n;
+    }
+    ssize_t n = source_pread(s, buf, buflen);
+    tape_put(s->path, n, buf, n > 0 ? (size_t)n : 0);
+    return n;
+}
 
+/* the names in a directory, each with its NUL and an empty one last */
+static void dir_list(const char *path, char *buf, size_t buflen) {
+    if (tape_replaying()) {
+        buf[0] = '\0';
+        tape_get(path, buf, buflen);
+        buf[buflen - 2] = buf[buflen - 1] = '\0';
+        return;
+    }
+    char full[512];
     size_t off = 0;
-    while (off + 1 < buflen) {
-        ssize_t n = read(fd, buf + off, (ssize_t)(buflen - 1 - off));
-        if (n > 0) {
-            off += (size_t)n;
-            if (off + 1 >= buflen) break;
-            continue;
-        } else if (n == 0) {
-            break;
-        } else {
-            if (errno == EINTR) continue;
-            break;
+    DIR *d = opendir(rooted(path, full, sizeof(full)));
+    count_syscalls(2);
+    if (d) {
+        struct dirent *de;
+        while ((de = readdir(d)) != NULL) {
+            size_t n = strlen(de->d_name) + 1;
+            if (off + n + 1 > buflen) break;
+            memcpy(buf + off, de->d_name, n);
+            off += n;
         }
+        closedir(d);
     }
-    buf[off] = '\0';
-    close(fd);
+    buf[off++] = '\0';
+    tape_put(path, d ? 0 : -1, buf, off);
 }
 
 static void trim_newline(char *s) {
@@ -62,663 +490,4458 @@ static void trim_newline(char *s) {
     }
 }
 
+/* ---------- event loop ---------- */
+
+/* every fd the reactor waits on is wrapped in a watch; epoll hands it back via data.ptr */
+struct watch {
+    int fd;
+    void (*on_ready)(struct watch *w, uint32_t events);
+};
+
+static struct {
+    int epfd;
+    unsigned gen;               /* bumped whenever a field's text changes */
+    unsigned flushed_gen;       /* gen of the last line written */
+} loop = { -1, 0, 0 };
+
+static int watch_add(struct watch *w, uint32_t events) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = w;
+    return epoll_ctl(loop.epfd, EPOLL_CTL_ADD, w->fd, &ev);
+}
+
+/* arm a relative monotonic one-shot (or periodic when interval is set) timer */
+static int timer_arm(int fd, int secs, int interval) {
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = secs;
+    its.it_interval.tv_sec = interval;
+    return timerfd_settime(fd, 0, &its, NULL);
+}
+
+static long long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static long long clock_ns(clockid_t id) {
+    struct timespec ts;
+    clock_gettime(id, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static long long now_ns(void) {
+    return clock_ns(CLOCK_MONOTONIC);
+}
+
+/* drain a timerfd; returns expirations, 0 when the timer was cancelled by a clock jump */
+static uint64_t timer_drain(int fd) {
+    uint64_t exp = 0;
+    for (;;) {
+        ssize_t n = read(fd, &exp, sizeof(exp));
+        count_syscalls(1);
+        if (n == (ssize_t)sizeof(exp)) return exp;
+        if (n < 0 && errno == EINTR) continue;
+        return 0;
+    }
+}
+
+/* the built-in collectors, then room for --plugin ones */
+#define PLUGIN_MAX 4
+
+enum { MOD_MEM, MOD_CPU, MOD_TEMP, MOD_DISK, MOD_NET, MOD_AUDIO, MOD_KB, MOD_BATT, MOD_TOP,
+       MOD_WIFI, MOD_PLUGIN, MOD_COUNT = MOD_PLUGIN + PLUGIN_MAX };
+
+/* collectors return 0, a level past a threshold on success, or -1 */
+enum { LEVEL_OK = INTELLIBAR_OK, LEVEL_WARN = INTELLIBAR_WARN, LEVEL_CRIT = INTELLIBAR_CRIT };
+
+static int level_for(long long v, long long warn, long long crit) {
+    if (crit != 0 && v > crit) return LEVEL_CRIT;
+    if (warn != 0 && v > warn) return LEVEL_WARN;
+    return LEVEL_OK;
+}
+
+/* event-driven sources call this after updating their state to re-render their field */
+static void module_refresh(int id);
+
+/* the user did something (a sway event): leave idle sampling, see the governor */
+static void gov_activity(void);
+
+/* ---------- series ---------- */
+
+#define SERIES_LEN 32
+
+/* the last SERIES_LEN samples of one metric, with no allocation. A running
+   sum gives the average and two monotonic deques of sample numbers give
+   the window min and max, all O(1) amortised per push */
+struct series {
+    long long v[SERIES_LEN];
+    unsigned long n;            /* samples pushed so far */
+    long long sum;
+    unsigned long minq[SERIES_LEN], maxq[SERIES_LEN];
+    int min_head, min_len, max_head, max_len;
+    double ewma;
+};
+
+static const char *const spark_glyphs[8] = { "▁", "▂", "▃", "▄", "▅", "▆", "▇", "█" };
+
+#define SQ(q, head, i) (q)[((head) + (i)) % SERIES_LEN]
+
+static void series_push(struct series *s, long long x, double alpha) {
+    if (s->n >= SERIES_LEN) {
+        unsigned long gone = s->n - SERIES_LEN;
+        s->sum -= s->v[gone % SERIES_LEN];
+        if (s->min_len && s->minq[s->min_head] == gone) {
+            s->min_head = (s->min_head + 1) % SERIES_LEN;
+            s->min_len--;
+        }
+        if (s->max_len && s->maxq[s->max_head] == gone) {
+            s->max_head = (s->max_head + 1) % SERIES_LEN;
+            s->max_len--;
+        }
+    }
+    s->v[s->n % SERIES_LEN] = x;
+    s->sum += x;
+
+    while (s->min_len && s->v[SQ(s->minq, s->min_head, s->min_len - 1) % SERIES_LEN] >= x)
+        s->min_len--;
+    SQ(s->minq, s->min_head, s->min_len) = s->n;
+    s->min_len++;
+    while (s->max_len && s->v[SQ(s->maxq, s->max_head, s->max_len - 1) % SERIES_LEN] <= x)
+        s->max_len--;
+    SQ(s->maxq, s->max_head, s->max_len) = s->n;
+    s->max_len++;
+
+    s->ewma = s->n == 0 ? (double)x : s->ewma + alpha * ((double)x - s->ewma);
+    s->n++;
+}
+
+static int series_count(const struct series *s) {
+    return s->n < SERIES_LEN ? (int)s->n : SERIES_LEN;
+}
+
+static long long series_min(const struct series *s) {
+    return s->min_len ? s->v[s->minq[s->min_head] % SERIES_LEN] : 0;
+}
+
+static long long series_max(const struct series *s) {
+    return s->max_len ? s->v[s->maxq[s->max_head] % SERIES_LEN] : 0;
+}
+
+static long long series_avg(const struct series *s) {
+    int c = series_count(s);
+    return c ? s->sum / c : 0;
+}
+
+/* write the newest `width` samples as block glyphs at out+off, scaled to
+   `scale` (0 = the window max); returns the new length of out */
+static size_t series_spark(const struct series *s, char *out, size_t off, size_t outlen,
+                           int width, long long scale) {
+    if (scale <= 0) scale = series_max(s);
+    if (scale <= 0) scale = 1;
+    int have = series_count(s);
+    for (int i = width; i > 0; --i) {
+        long long x = i <= have ? s->v[(s->n - (unsigned long)i) % SERIES_LEN] : 0;
+        if (x < 0) x = 0;
+        if (x > scale) x = scale;
+        const char *glyph = spark_glyphs[x * 7 / scale];
+        size_t len = strlen(glyph);
+        if (off + len + 1 > outlen) break;
+        memcpy(out + off, glyph, len);
+        off += len;
+    }
+    out[off] = '\0';
+    return off;
+}
+
+/* ---------- rates ---------- */
+
+/* shortest gap worth a rate sample; also the sleep that voids one */
+#define RATE_MIN_GAP_NS 500000000LL
+
+/* counters become rates over the real time between reads, not the nominal
+   interval: a late worker or an early refresh would otherwise skew them.
+   MONOTONIC stops across suspend and BOOTTIME does not, so their drift since
+   the baseline is how long the machine slept */
+struct rate_clock {
+    int primed;                 /* a baseline has been taken */
+    long long mono, boot;
+};
+
+/* awake ns since the baseline and the baseline moved to now; 0 when there is
+   no usable sample (first read, or it spanned a suspend) but the baseline
+   moved anyway; -1 when too soon, leaving the baseline (and counters) alone */
+static long long rate_tick(struct rate_clock *rc) {
+    long long now[2] = { clock_ns(CLOCK_MONOTONIC), clock_ns(CLOCK_BOOTTIME) };
+    tape_value("clock", now, sizeof(now));
+    long long mono = now[0], boot = now[1];
+    long long awake = mono - rc->mono, asleep = (boot - rc->boot) - awake;
+    int primed = rc->primed;
+    if (primed && awake < RATE_MIN_GAP_NS) return -1;
+    rc->primed = 1;
+    rc->mono = mono;
+    rc->boot = boot;
+    return primed && asleep < RATE_MIN_GAP_NS ? awake : 0;
+}
+
+/* bytes between two counter reads; a drop below a 32-bit previous value is
+   a wrap of a 32-bit driver counter, anything else is a reset (-1) */
+static long long counter_delta(unsigned long long prev, unsigned long long cur) {
+    if (cur >= prev) return (long long)(cur - prev);
+    if (prev <= 0xffffffffULL) return (long long)(cur + 0x100000000ULL - prev);
+    return -1;
+}
+
+/* KiB/s from two byte counters over awake ns; -1 when the counter was reset */
+static long long rate_kib(unsigned long long prev, unsigned long long cur, long long awake) {
+    long long d = counter_delta(prev, cur);
+    return d < 0 ? -1 : (long long)((double)d * 1e9 / 1024 / (double)awake);
+}
+
+/* ---------- pressure stall information ---------- */
+
+/* percent of the last 10 s in which some task waited on the resource; -1
+   without PSI (CONFIG_PSI off or psi=0 on the kernel command line) */
+static int psi_some(struct source *src) {
+    char buf[256];
+    if (source_read(src, buf, sizeof(buf)) <= 0 || strncmp(buf, "some avg10=", 11) != 0) return -1;
+    return (int)(strtod(buf + 11, NULL) + 0.5);
+}
+
+/* " psi NN%" and its level, or nothing when PSI is off or unavailable */
+static int psi_append(struct source *src, struct text *t) {
+    int pct = __atomic_load_n(&cfg.psi, __ATOMIC_RELAXED) ? psi_some(src) : -1;
+    if (pct >= 0) {
+        text_str(t, " psi");
+        text_num(t, pct, 3);
+        text_str(t, "%");
+    }
+    text_end(t);
+    return pct >= 0 ? level_for(pct, PSI_WARN, PSI_CRIT) : LEVEL_OK;
+}
+
 /* ---------- RAM ---------- */
 
-static void get_mem(char *out, size_t outlen) {
-    char buf[1024];
-    read_file("/proc/meminfo", buf, sizeof(buf));
-    long long total = 0, avail = 0;
-    char *p = buf;
-    while (*p) {
-        if (strncmp(p, "MemTotal:", 9) == 0) {
-            sscanf(p + 9, "%lld", &total);
-        } else if (strncmp(p, "MemAvailable:", 13) == 0) {
-            sscanf(p + 13, "%lld", &avail);
-        }
-        while (*p && *p != '\n') p++;
-        if (*p == '\n') p++;
+enum { MEM_SWAP = 1, MEM_CACHED = 2, MEM_DIRTY = 4, MEM_SHMEM = 8 };
+
+/* the /proc/meminfo lines the RAM field can use, in file order */
+enum { MI_TOTAL, MI_AVAIL, MI_CACHED, MI_SWAP_TOTAL, MI_SWAP_FREE, MI_DIRTY, MI_SHMEM, MI_KEYS };
+
+static const struct {
+    const char *name;
+    size_t len;
+} meminfo_keys[MI_KEYS] = {
+    { "MemTotal", 8 }, { "MemAvailable", 12 }, { "Cached", 6 }, { "SwapTotal", 9 },
+    { "SwapFree", 8 }, { "Dirty", 5 }, { "Shmem", 5 },
+};
+
+/* one pass over the file: each line's name is looked up in the table and the
+   kB values of the wanted keys (a mask of 1 << MI_*) are stored in v.
+   Stops once all of them are found; returns the mask of keys found */
+static unsigned meminfo_parse(const char *p, unsigned want, long long *v) {
+    unsigned found = 0;
+    while (*p && (found & want) != want) {
+        const char *eol = strchr(p, '\n');
+        if (!eol) break;                    /* cut off by the buffer */
+        const char *colon = (const char *)memchr(p, ':', (size_t)(eol - p));
+        if (colon) {
+            size_t len = (size_t)(colon - p);
+            for (int k = 0; k < MI_KEYS; ++k) {
+                if (!((want >> k) & 1) || meminfo_keys[k].len != len ||
+                    memcmp(p, meminfo_keys[k].name, len) != 0) continue;
+                v[k] = strtoll(colon + 1, NULL, 10);
+                found |= 1u << k;
+                break;
+            }
+        }
+        p = eol + 1;
+    }
+    return found;
+}
+
+/* kB as five characters, precise enough for a small VM: "612Mi", "5.4Gi", " 12Gi" */
+static void text_size(struct text *t, long long kib) {
+    long long mib = (kib + 512) / 1024;
+    long long tenths = (kib * 10 + 524288) / 1048576;
+    if (mib < 1000) {
+        text_num(t, mib, 3);
+        text_str(t, "Mi");
+    } else if (tenths < 100) {
+        text_num(t, tenths / 10, 1);
+        text_str(t, ".");
+        text_num(t, tenths % 10, 1);
+        text_str(t, "Gi");
+    } else {
+        text_num(t, (kib + 524288) / 1048576, 3);
+        text_str(t, "Gi");
     }
+}
+
+static struct series mem_hist;     /* used % */
+
+static int get_mem(char *out, size_t outlen) {
+    static struct source src = SOURCE("/proc/meminfo");
+    static struct source psi = SOURCE("/proc/pressure/memory");
+    static const struct {
+        int extra;
+        const char *label;
+        int key;                    /* the value shown */
+        unsigned also;              /* other keys it needs */
+    } extras[] = {
+        { MEM_SWAP, "swap", MI_SWAP_TOTAL, 1u << MI_SWAP_FREE },
+        { MEM_CACHED, "cache", MI_CACHED, 0 },
+        { MEM_DIRTY, "dirty", MI_DIRTY, 0 },
+        { MEM_SHMEM, "shm", MI_SHMEM, 0 },
+    };
+    /* every key in the table sits in the first kB, so one pread covers them */
+    char buf[1024];
+    source_read(&src, buf, sizeof(buf));
+
+    int extra = __atomic_load_n(&cfg.mem_extra, __ATOMIC_RELAXED);
+    unsigned want = 1u << MI_TOTAL | 1u << MI_AVAIL;
+    for (size_t i = 0; i < sizeof(extras) / sizeof(extras[0]); ++i)
+        if (extra & extras[i].extra) want |= 1u << extras[i].key | extras[i].also;
+    long long v[MI_KEYS] = {0};
+    meminfo_parse(buf, want, v);
+    long long total = v[MI_TOTAL], avail = v[MI_AVAIL];
     if (total <= 0) {
         snprintf(out, outlen, "N/A");
+        return -1;
+    }
+    v[MI_SWAP_TOTAL] -= v[MI_SWAP_FREE];        /* swap shows what is used */
+
+    series_push(&mem_hist, 100 * (total - avail) / total, 1.0);
+    struct text t = TEXT(out, outlen);
+    text_size(&t, total - avail);
+    text_str(&t, "/");
+    text_size(&t, total);
+    if (SPARK_WIDTH) {
+        text_str(&t, " ");
+        t.len = series_spark(&mem_hist, out, t.len, outlen, SPARK_WIDTH, 100);
+    }
+    for (size_t i = 0; i < sizeof(extras) / sizeof(extras[0]); ++i) {
+        if (!(extra & extras[i].extra)) continue;
+        text_str(&t, " ");
+        text_str(&t, extras[i].label);
+        text_str(&t, " ");
+        text_size(&t, v[extras[i].key]);
+    }
+    return psi_append(&psi, &t);
+}
+
+/* ---------- Disk ---------- */
+
+#define DISK_MAX_MOUNTS 8
+#define DISK_MIN_PERIOD 30      /* seconds between statvfs while space is moving */
+#define DISK_MAX_PERIOD 600     /* ...backing off to this while it is not */
+
+struct disk_mount {
+    char path[CFG_STR];
+    unsigned major, minor;      /* backing device; major 0 (tmpfs, btrfs...) has no diskstats */
+    int ok;                     /* the last statvfs worked */
+    long long avail, total;     /* bytes */
+    long long due;              /* monotonic s of the next statvfs */
+    int period;
+    struct rate_clock clock;
+    unsigned long long prev_rd, prev_wr;        /* bytes */
+    long long rd_kib, wr_kib;
+};
+
+static struct {
+    int rescan;                 /* cfg.disk or the mount table changed */
+    int count;
+    struct disk_mount mounts[DISK_MAX_MOUNTS];
+} disk = { 1, 0, {} };
+
+/* mountinfo escapes space, tab, newline and backslash as \ooo */
+static void mount_unescape(char *p) {
+    char *o = p;
+    for (; *p; ++p, ++o) {
+        if (p[0] == '\\' && p[1] >= '0' && p[1] <= '3' && p[2] >= '0' && p[2] <= '7' &&
+            p[3] >= '0' && p[3] <= '7') {
+            *o = (char)((p[1] - '0') * 64 + (p[2] - '0') * 8 + (p[3] - '0'));
+            p += 3;
+        } else {
+            *o = *p;
+        }
+    }
+    *o = '\0';
+}
+
+static struct disk_mount *disk_add(const char *path, unsigned major, unsigned minor) {
+    for (int i = 0; i < disk.count; ++i)
+        if (strcmp(disk.mounts[i].path, path) == 0) return &disk.mounts[i];
+    if (disk.count == DISK_MAX_MOUNTS) return NULL;
+    struct disk_mount *m = &disk.mounts[disk.count++];
+    memset(m, 0, sizeof(*m));
+    snprintf(m->path, sizeof(m->path), "%s", path);
+    m->major = major;
+    m->minor = minor;
+    m->period = DISK_MIN_PERIOD;
+    return m;
+}
+
+/* resolve cfg.disk against /proc/self/mountinfo: named mounts get their
+   device for throughput, "all" takes every filesystem on a block device once */
+static void disk_scan(void) {
+    static struct source src = SOURCE("/proc/self/mountinfo");
+    static char buf[65536];
+    char want[CFG_STR];
+    cfg_get(want, sizeof(want), cfg.disk);
+    int all = strcmp(want, "all") == 0;
+    static struct disk_mount prev[DISK_MAX_MOUNTS];
+    int prev_count = disk.count;
+    memcpy(prev, disk.mounts, sizeof(prev));
+    disk.count = 0;
+    char *save = NULL;
+    if (!all)
+        for (char *tok = strtok_r(want, " \t,", &save); tok; tok = strtok_r(NULL, " \t,", &save))
+            disk_add(tok, 0, 0);
+
+    source_read(&src, buf, sizeof(buf));
+    for (char *line = buf, *next; *line; line = next) {
+        next = strchr(line, '\n');
+        if (next) *next++ = '\0';
+        else next = line + strlen(line);
+
+        /* "36 35 98:0 /root /mnt opts [optional...] - fstype source superopts" */
+        unsigned major, minor;
+        char mnt[CFG_STR], fstype[32], source[CFG_STR];
+        const char *sep = strstr(line, " - ");
+        if (!sep || sscanf(line, "%*u %*u %u:%u %*s %63s", &major, &minor, mnt) != 3 ||
+            sscanf(sep + 3, "%31s %63s", fstype, source) != 2)
+            continue;
+        mount_unescape(mnt);
+        if (all) {
+            if (strncmp(source, "/dev/", 5) != 0 || strcmp(fstype, "squashfs") == 0) continue;
+            int dup = 0;
+            for (int i = 0; i < disk.count; ++i)
+                dup |= disk.mounts[i].major == major && disk.mounts[i].minor == minor;
+            if (!dup) disk_add(mnt, major, minor);
+            continue;
+        }
+        for (int i = 0; i < disk.count; ++i) {
+            if (strcmp(disk.mounts[i].path, mnt) != 0) continue;
+            disk.mounts[i].major = major;           /* last one wins, as with overmounts */
+            disk.mounts[i].minor = minor;
+        }
+    }
+
+    /* mounts that survived keep their backoff and throughput baselines */
+    for (int i = 0; i < disk.count; ++i) {
+        struct disk_mount *m = &disk.mounts[i];
+        for (int k = 0; k < prev_count; ++k)
+            if (strcmp(prev[k].path, m->path) == 0 && prev[k].major == m->major && prev[k].minor == m->minor)
+                *m = prev[k];
+    }
+}
+
+/* read/write rates per mounted device from one pass over diskstats (512-byte sectors) */
+static void disk_read_io(void) {
+    static struct source src = SOURCE("/proc/diskstats");
+    static char buf[32768];
+    if (source_read(&src, buf, sizeof(buf)) <= 0) return;
+
+    int seen[DISK_MAX_MOUNTS] = {0};
+    for (char *line = buf, *next; *line; line = next) {
+        next = strchr(line, '\n');
+        next = next ? next + 1 : line + strlen(line);
+        unsigned major, minor;
+        unsigned long long rd, wr;
+        if (sscanf(line, "%u %u %*s %*u %*u %llu %*u %*u %*u %llu", &major, &minor, &rd, &wr) != 4)
+            continue;
+        for (int i = 0; i < disk.count; ++i) {
+            struct disk_mount *m = &disk.mounts[i];
+            if (seen[i] || !major || m->major != major || m->minor != minor) continue;
+            seen[i] = 1;
+            long long awake = rate_tick(&m->clock);
+            if (awake < 0) continue;
+            rd *= 512;
+            wr *= 512;
+            long long r = awake ? rate_kib(m->prev_rd, rd, awake) : -1;
+            long long w = awake ? rate_kib(m->prev_wr, wr, awake) : -1;
+            if (r >= 0 && w >= 0) {
+                m->rd_kib = r;
+                m->wr_kib = w;
+            }
+            m->prev_rd = rd;
+            m->prev_wr = wr;
+        }
+    }
+}
+
+/* free space barely moves, so each mount backs off while it is stable */
+static void disk_sample(struct disk_mount *m, long long now) {
+    long long space[3] = { -1, 0, 0 };          /* statvfs result, avail, total */
+    if (tape_replaying()) {
+        tape_get(m->path, space, sizeof(space));
+    } else {
+        struct statvfs st;
+        char full[512];
+        count_syscalls(1);
+        if (statvfs(rooted(m->path, full, sizeof(full)), &st) == 0) {
+            space[0] = 0;
+            space[1] = (long long)st.f_bavail * st.f_frsize;
+            space[2] = (long long)st.f_blocks * st.f_frsize;
+        }
+        tape_put(m->path, space[0], space, sizeof(space));
+    }
+    if (space[0] != 0) {
+        m->ok = 0;
+        m->period = DISK_MIN_PERIOD;
+        m->due = now + m->period;
         return;
     }
-    long long used_gib = (total - avail) / 1048576;
-    long long total_gib = total / 1048576;
-    snprintf(out, outlen, "%2lldGi/%2lldGi", used_gib, total_gib);
+    long long avail = space[1], total = space[2];
+    long long moved = avail > m->avail ? avail - m->avail : m->avail - avail;
+    if (m->ok && moved * 200 < total) {             /* under 0.5% since the last look */
+        m->period *= 2;
+        if (m->period > DISK_MAX_PERIOD) m->period = DISK_MAX_PERIOD;
+    } else {
+        m->period = DISK_MIN_PERIOD;
+    }
+    m->ok = 1;
+    m->avail = avail;
+    m->total = total;
+    m->due = now + m->period;
+}
+
+static int get_disk(char *out, size_t outlen) {
+    if (flag_take(&disk.rescan)) disk_scan();
+    int io = __atomic_load_n(&cfg.disk_io, __ATOMIC_RELAXED);
+    if (io) disk_read_io();
+
+    long long now = now_ms() / 1000;
+    tape_value("now", &now, sizeof(now));
+    const long long gib = 1024LL * 1024LL * 1024LL;
+    size_t off = 0;
+    int good = 0;
+    out[0] = '\0';
+    for (int i = 0; i < disk.count && off < outlen; ++i) {
+        struct disk_mount *m = &disk.mounts[i];
+        if (now + 1 >= m->due) disk_sample(m, now);
+        if (disk.count > 1)
+            off += (size_t)snprintf(out + off, outlen - off, "%s%s ", i ? " " : "", m->path);
+        if (off >= outlen) break;
+        if (!m->ok) {
+            off += (size_t)snprintf(out + off, outlen - off, "N/A");
+            continue;
+        }
+        good++;
+        off += (size_t)snprintf(out + off, outlen - off, "%3lldGi/%3lldGi", m->avail / gib, m->total / gib);
+        if (io && m->major && off < outlen)
+            off += (size_t)snprintf(out + off, outlen - off, " r%4lld w%4lld KiB/s", m->rd_kib, m->wr_kib);
+    }
+    if (!good) {
+        snprintf(out, outlen, "N/A");
+        return -1;
+    }
+    return 0;
+}
+
+/* ---------- CPU ---------- */
+
+#define CPU_MAX 256
+#define CPU_SPARK_WIDTH 16          /* cores are grouped (max) beyond this many glyphs */
+
+enum { CPU_USER, CPU_NICE, CPU_SYSTEM, CPU_IDLE, CPU_IOWAIT, CPU_IRQ, CPU_SOFTIRQ, CPU_STEAL,
+       CPU_STATES };
+
+/* struct-of-arrays snapshot of /proc/stat; row 0 is the aggregate "cpu" line,
+   row k+1 is cpuk (offline cores leave zero rows) */
+struct cpu_snap {
+    int rows;
+    unsigned long long v[CPU_STATES][CPU_MAX + 1];
+};
+
+static struct {
+    struct cpu_snap snap[2];
+    int cur;
+    int primed;
+    struct series hist;         /* aggregate busy % */
+} cpu_state;
+
+/* SWAR decimal scan: classify 8 bytes at once and convert the digit run with
+   three multiplies. Callers keep 8 bytes of slack after the text */
+static inline unsigned long long scan_u64(const char **pp) {
+    static const unsigned long long pow10[9] = {
+        1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000 };
+    const char *p = *pp;
+    while (*p == ' ') p++;
+    unsigned long long v = 0;
+    for (;;) {
+        uint64_t chunk;
+        memcpy(&chunk, p, sizeof(chunk));
+        uint64_t nondigit = ((chunk & 0xF0F0F0F0F0F0F0F0ULL) |
+                             (((chunk + 0x0606060606060606ULL) & 0xF0F0F0F0F0F0F0F0ULL) >> 4)) ^
+                            0x3333333333333333ULL;
+        int n = nondigit ? __builtin_ctzll(nondigit) / 8 : 8;
+        if (n == 0) break;
+        uint64_t x = chunk << (8 * (8 - n));        /* most significant digit first, zero padded */
+        x = ((x & 0x0F0F0F0F0F0F0F0FULL) * 2561) >> 8;
+        x = ((x & 0x00FF00FF00FF00FFULL) * 6553601) >> 16;
+        x = ((x & 0x0000FFFF0000FFFFULL) * 42949672960001ULL) >> 32;
+        v = v * pow10[n] + x;
+        p += n;
+        if (n < 8) break;
+    }
+    *pp = p;
+    return v;
+}
+
+/* the cpu lines come first in /proc/stat; stop at the first other line */
+static int cpu_parse(const char *p, struct cpu_snap *snap) {
+    snap->rows = 0;
+    while (p[0] == 'c' && p[1] == 'p' && p[2] == 'u') {
+        p += 3;
+        int row = 0;
+        if (*p != ' ') row = (int)scan_u64(&p) + 1;
+        if (row > CPU_MAX) break;
+        for (int st = 0; st < CPU_STATES; ++st) snap->v[st][row] = scan_u64(&p);
+        if (row >= snap->rows) snap->rows = row + 1;
+        while (*p && *p != '\n') p++;       /* guest, guest_nice */
+        if (*p == '\n') p++;
+    }
+    return snap->rows > 0 ? 0 : -1;
+}
+
+/* busy and iowait share of one row between two snapshots, in percent */
+static int cpu_row_delta(const struct cpu_snap *a, const struct cpu_snap *b, int row,
+                         int *busy, int *iowait) {
+    unsigned long long d[CPU_STATES], total = 0;
+    for (int st = 0; st < CPU_STATES; ++st) {
+        d[st] = b->v[st][row] - a->v[st][row];
+        total += d[st];
+    }
+    if (total == 0 || (long long)total < 0) return -1;
+    *busy = (int)(100 * (total - d[CPU_IDLE]) / total);
+    *iowait = (int)(100 * d[CPU_IOWAIT] / total);
+    return 0;
+}
+
+/* the worse of utilisation and CPU pressure picks the colour */
+static int cpu_level(int pct, struct text *t) {
+    static struct source psi = SOURCE("/proc/pressure/cpu");
+    int stalled = psi_append(&psi, t);
+    int busy = level_for(pct, CPU_WARN, CPU_CRIT);
+    return busy > stalled ? busy : stalled;
+}
+
+static int get_cpu_usage(char *out, size_t outlen) {
+    static struct source src = SOURCE("/proc/stat");
+    static char buf[(CPU_MAX + 1) * 128 + 8];
+    source_read(&src, buf, sizeof(buf) - 8);
+
+    struct cpu_snap *now = &cpu_state.snap[cpu_state.cur];
+    if (cpu_parse(buf, now) != 0) {
+        snprintf(out, outlen, "  0%%");
+        return -1;
+    }
+    const struct cpu_snap *prev = &cpu_state.snap[cpu_state.cur ^ 1];
+    cpu_state.cur ^= 1;
+
+    /* the first read is only a baseline: show 0% in the full layout, with an
+       empty history, so the field keeps its width from the start */
+    int primed = cpu_state.primed;
+    cpu_state.primed = 1;
+    int pct = 0, io = 0;
+    if (primed) {
+        cpu_row_delta(prev, now, 0, &pct, &io);
+        if (pct > 100) pct = 100;
+        series_push(&cpu_state.hist, pct, 1.0);
+    }
+
+    struct text t = TEXT(out, outlen);
+    text_num(&t, pct, 3);
+    text_str(&t, "%");
+
+    /* the per-core modes already fill the field, so only these get history */
+    int mode = __atomic_load_n(&cfg.cpu_mode, __ATOMIC_RELAXED);
+    if (mode == CPU_SHOW_IOWAIT || mode == CPU_SHOW_TOTAL) {
+        if (mode == CPU_SHOW_IOWAIT) {
+            text_str(&t, " io");
+            text_num(&t, io, 3);
+            text_str(&t, "%");
+        }
+        if (SPARK_WIDTH) {
+            text_str(&t, " ");
+            t.len = series_spark(&cpu_state.hist, out, t.len, outlen, SPARK_WIDTH, 100);
+        }
+        return cpu_level(pct, &t);
+    }
+
+    int cores = now->rows - 1;
+    int width = cores < CPU_SPARK_WIDTH ? cores : CPU_SPARK_WIDTH;
+    int group_max[CPU_SPARK_WIDTH] = {0};
+    int max_core = 0;
+    for (int c = 0; c < cores; ++c) {
+        int busy, iow;
+        if (!primed || cpu_row_delta(prev, now, c + 1, &busy, &iow) != 0) continue;
+        if (busy > 100) busy = 100;
+        if (busy > max_core) max_core = busy;
+        int g = (int)((long long)c * width / cores);
+        if (busy > group_max[g]) group_max[g] = busy;
+    }
+
+    if (mode == CPU_SHOW_MAXCORE) {
+        text_str(&t, " max");
+        text_num(&t, max_core, 3);
+        text_str(&t, "%");
+        return cpu_level(pct, &t);
+    }
+
+    text_str(&t, " ");
+    for (int g = 0; g < width; ++g) text_str(&t, spark_glyphs[group_max[g] * 7 / 100]);
+    return cpu_level(pct, &t);
+}
+
+/* ---------- Top processes ---------- */
+
+#define TOP_MAX 3
+#define TOP_PIDS 2048               /* processes tracked; more are skipped */
+#define TOP_HASH 4096               /* power of two, twice TOP_PIDS */
+/* a scan may take at most 1/TOP_BUDGET of the time since the last one
+   (0.5% of a core); until then the previous result is shown again */
+#define TOP_BUDGET 200
+/* a process that used no CPU at its last read is re-read every TOP_IDLE_EVERY
+   scans only (staggered by pid), so a box full of sleepers costs a fraction
+   of a full walk; new and busy processes are read every scan */
+#define TOP_IDLE_EVERY 4
+
+/* what the per-process fd is kept open on. /proc/<pid>/stat makes the
+   kernel format 52 fields (about 1.6 us a read here); schedstat (CPU time in
+   ns) and statm (pages) cost a third of that, so only the winners' stat is
+   read, for their names. Without CONFIG_SCHED_INFO CPU falls back to stat */
+enum { TOP_SRC_SCHEDSTAT, TOP_SRC_STAT, TOP_SRC_STATM };
+
+static const char *const top_src_file[] = { "schedstat", "stat", "statm" };
+
+/* one process as of the last scan; the fd keeps pointing at the same
+   process even when its pid is reused, and fails once it has exited */
+struct proc {
+    int pid, fd;
+    unsigned long long cpu;         /* ns, or clock ticks from stat */
+    long long rss_kib;
+    long long sampled_ns;           /* when cpu and rss_kib were read */
+    int pct;                        /* of one core between its last two reads, -1 after one */
+};
+
+static struct {
+    int dir;                        /* /proc, rewound for every scan */
+    int max_fds;                    /* fds kept open, under RLIMIT_NOFILE */
+    int src;                        /* TOP_SRC_* the cached fds are on */
+    int no_schedstat;
+    long clk_tck, page_kib;
+    struct proc procs[2][TOP_PIDS];
+    int count[2], cur;
+    int hash[TOP_HASH];             /* pid -> index + 1 into procs[cur] */
+    unsigned scans;
+    long long scanned_ns, cost_ns;
+    char last[FIELD_LEN];
+    int last_rc;
+} top = { -1, 0, TOP_SRC_SCHEDSTAT, 0, 0, 0, {}, {0, 0}, 0, {0}, 0, 0, 0, {0}, -1 };
+
+static int top_lookup(int pid) {
+    for (unsigned h = (unsigned)pid * 2654435761u % TOP_HASH;; h = (h + 1) % TOP_HASH) {
+        int i = top.hash[h] - 1;
+        if (i < 0 || top.procs[top.cur][i].pid == pid) return i;
+    }
+}
+
+static void top_rehash(void) {
+    memset(top.hash, 0, sizeof(top.hash));
+    for (int i = 0; i < top.count[top.cur]; ++i) {
+        unsigned h = (unsigned)top.procs[top.cur][i].pid * 2654435761u % TOP_HASH;
+        while (top.hash[h]) h = (h + 1) % TOP_HASH;
+        top.hash[h] = i + 1;
+    }
+}
+
+/* "pid (comm) S ppid ..." from proc(5): comm may hold spaces and parens, so
+   fields are counted from the last ')'; utime is field 14, stime 15, rss 24.
+   Callers keep 8 bytes of slack for scan_u64 */
+static int proc_stat_parse(const char *buf, size_t len, char *comm, size_t commlen,
+                           unsigned long long *ticks, long long *rss_kib) {
+    const char *open = (const char *)memchr(buf, '(', len);
+    const char *close = (const char *)memrchr(buf, ')', len);
+    if (!open || !close || close < open) return -1;
+    size_t n = (size_t)(close - open - 1);
+    if (n > commlen - 1) n = commlen - 1;
+    memcpy(comm, open + 1, n);
+    comm[n] = '\0';
+
+    const char *q = close + 2, *end = buf + len;
+    for (int field = 3; field < 14; ++field) {
+        q = (const char *)memchr(q, ' ', (size_t)(end - q));
+        if (!q) return -1;
+        q++;
+    }
+    unsigned long long utime = scan_u64(&q), stime = scan_u64(&q);
+    for (int field = 16; field < 24; ++field) {
+        q = (const char *)memchr(q + 1, ' ', (size_t)(end - q - 1));
+        if (!q) return -1;
+    }
+    *ticks = utime + stime;
+    *rss_kib = (long long)scan_u64(&q) * top.page_kib;
+    return 0;
+}
+
+/* bounded min-heap: the cap biggest keys offered so far, smallest at the root */
+struct top_heap {
+    int n, cap;
+    long long key[TOP_MAX];
+    int idx[TOP_MAX];
+};
+
+static void heap_offer(struct top_heap *h, long long key, int idx) {
+    int i;
+    if (h->n < h->cap) {
+        for (i = h->n++; i > 0 && h->key[(i - 1) / 2] > key; i = (i - 1) / 2) {
+            h->key[i] = h->key[(i - 1) / 2];
+            h->idx[i] = h->idx[(i - 1) / 2];
+        }
+    } else {
+        if (h->n == 0 || key <= h->key[0]) return;
+        for (i = 0;;) {
+            int c = 2 * i + 1;
+            if (c >= h->n) break;
+            if (c + 1 < h->n && h->key[c + 1] < h->key[c]) c++;
+            if (h->key[c] >= key) break;
+            h->key[i] = h->key[c];
+            h->idx[i] = h->idx[c];
+            i = c;
+        }
+    }
+    h->key[i] = key;
+    h->idx[i] = idx;
+}
+
+static void top_init(void) {
+    if (tape_replaying()) {
+        tape_value("top dir", &top.dir, sizeof(top.dir));
+        tape_value("clk_tck", &top.clk_tck, sizeof(top.clk_tck));
+        tape_value("page_kib", &top.page_kib, sizeof(top.page_kib));
+        tape_value("top fds", &top.max_fds, sizeof(top.max_fds));
+        return;
+    }
+    char full[512];
+    top.dir = open(rooted("/proc", full, sizeof(full)), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    count_syscalls(1);
+    top.clk_tck = sysconf(_SC_CLK_TCK);
+    top.page_kib = sysconf(_SC_PAGESIZE) / 1024;
+    tape_value("top dir", &top.dir, sizeof(top.dir));
+    tape_value("clk_tck", &top.clk_tck, sizeof(top.clk_tck));
+    tape_value("page_kib", &top.page_kib, sizeof(top.page_kib));
+
+    /* one fd per process needs more than the usual soft limit of 1024 */
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+        rlim_t want = TOP_PIDS + 256;
+        if (rl.rlim_cur < want) {
+            rl.rlim_cur = rl.rlim_max < want ? rl.rlim_max : want;
+            setrlimit(RLIMIT_NOFILE, &rl);
+            getrlimit(RLIMIT_NOFILE, &rl);
+        }
+        top.max_fds = rl.rlim_cur > 256 ? (int)(rl.rlim_cur - 256) : 0;
+    }
+    tape_value("top fds", &top.max_fds, sizeof(top.max_fds));
+}
+
+/* the walk's system calls, taped: an open logs its fd or -errno, a read or
+   directory chunk its bytes. A replayed open hands out TAPE_FD */
+static int top_open(int pid, const char *file) {
+    char path[48];
+    snprintf(path, sizeof(path), "%d/%s", pid, file);
+    if (tape_replaying()) {
+        char unused;
+        long long fd = tape_get(path, &unused, 0);
+        if (fd >= 0) return TAPE_FD;
+        errno = (int)-fd;
+        return -1;
+    }
+    count_syscalls(1);
+    int fd = openat(top.dir, path, O_RDONLY | O_CLOEXEC);
+    tape_put(path, fd < 0 ? -errno : fd, NULL, 0);
+    return fd;
+}
+
+static ssize_t top_pread(int fd, char *buf, size_t len) {
+    if (tape_replaying()) return (ssize_t)tape_get("pread", buf, len);
+    ssize_t n = pread(fd, buf, len, 0);
+    count_syscalls(1);
+    tape_put("pread", n, buf, n > 0 ? (size_t)n : 0);
+    return n;
+}
+
+static ssize_t top_getdents(char *buf, size_t len) {
+    if (tape_replaying()) return (ssize_t)tape_get("getdents", buf, len);
+    ssize_t n = getdents64(top.dir, buf, len);
+    count_syscalls(1);
+    tape_put("getdents", n, buf, n > 0 ? (size_t)n : 0);
+    return n;
+}
+
+static void top_close(int fd) {
+    if (fd == TAPE_FD) return;
+    close(fd);
+    count_syscalls(1);
+}
+
+/* one read of the process's cached file; -1 once it has exited (ESRCH) */
+static int top_sample(struct proc *p, int src) {
+    char buf[512 + 8], comm[16];
+    ssize_t len = top_pread(p->fd, buf, sizeof(buf) - 8 - 1);
+    if (len <= 0) return -1;
+    buf[len] = '\0';
+    const char *q = buf;
+    switch (src) {
+    case TOP_SRC_SCHEDSTAT:
+        p->cpu = scan_u64(&q);
+        return 0;
+    case TOP_SRC_STATM:
+        scan_u64(&q);
+        p->rss_kib = (long long)scan_u64(&q) * top.page_kib;
+        return 0;
+    default:
+        return proc_stat_parse(buf, (size_t)len, comm, sizeof(comm), &p->cpu, &p->rss_kib);
+    }
+}
+
+/* one scan in progress: procs[cur] is read into procs[cur ^ 1] */
+struct top_walk {
+    struct top_heap *h;
+    int by_mem, src, primed;
+    unsigned scan;
+    long long now;
+    struct proc *old, *cur;
+    int n, fds;
+};
+
+/* carry a pid over from the last scan (or start tracking it) and sample it */
+static void top_visit(struct top_walk *w, int pid) {
+    if (w->n == TOP_PIDS) return;
+    struct proc *p = &w->cur[w->n];
+    int k = w->primed ? top_lookup(pid) : -1;
+    if (k >= 0) {
+        *p = w->old[k];
+        w->old[k].fd = -1;              /* moved */
+    } else {
+        p->pid = pid;
+        p->fd = -1;
+    }
+
+    /* idle last time: keep its numbers until its turn comes */
+    if (k >= 0 && !w->by_mem && p->pct == 0 && (unsigned)pid % TOP_IDLE_EVERY != w->scan % TOP_IDLE_EVERY) {
+        if (p->fd >= 0) w->fds++;
+        heap_offer(w->h, 0, w->n++);
+        return;
+    }
+    unsigned long long prev = p->cpu;
+    long long elapsed = w->now - p->sampled_ns;
+    if (p->fd < 0) {
+        p->fd = top_open(pid, top_src_file[w->src]);
+        if (p->fd < 0 && errno == ENOENT && w->src == TOP_SRC_SCHEDSTAT && pid == 1) {
+            top.no_schedstat = 1;       /* the kernel has no schedstat at all */
+            w->src = TOP_SRC_STAT;
+            p->fd = top_open(pid, top_src_file[w->src]);
+        }
+        if (p->fd < 0) return;          /* exited meanwhile */
+    }
+    if (top_sample(p, w->src) != 0) {
+        top_close(p->fd);
+        return;
+    }
+    if (w->fds >= top.max_fds) {        /* over the fd budget: reopened next time */
+        top_close(p->fd);
+        p->fd = -1;
+    } else {
+        w->fds++;
+    }
+    double per_sec = w->src == TOP_SRC_STAT ? (double)top.clk_tck : 1e9;
+    p->pct = k >= 0 && elapsed > 0 ? (int)((double)(p->cpu - prev) * 100 * 1e9 / per_sec / (double)elapsed + 0.5) : -1;
+    p->sampled_ns = w->now;
+    heap_offer(w->h, w->by_mem ? p->rss_kib : p->pct < 0 ? 0 : p->pct, w->n++);
+}
+
+/* the newest pid the kernel handed out, from /proc/loadavg */
+static int top_newest_pid(void) {
+    static struct source src = SOURCE("/proc/loadavg");
+    char buf[128];
+    if (source_read(&src, buf, sizeof(buf)) <= 0) return -1;
+    const char *sp = strrchr(buf, ' ');
+    return sp ? atoi(sp + 1) : -1;
+}
+
+/* reuse the cached fd of every known pid, open new ones and close those
+   whose process is gone, keeping the biggest in a heap. Reading /proc itself
+   costs as much as a few hundred samples, so it is only walked when a pid
+   was created since the last walk; otherwise the known pids are re-read */
+static int top_scan(struct top_heap *h, int by_mem) {
+    static int walked_newest = -1;
+    if (top.dir < 0) top_init();
+    if (top.dir < 0 || top.clk_tck <= 0) return -1;
+
+    struct top_walk w;
+    w.h = h;
+    w.by_mem = by_mem;
+    w.src = by_mem ? TOP_SRC_STATM : top.no_schedstat ? TOP_SRC_STAT : TOP_SRC_SCHEDSTAT;
+    w.primed = top.scanned_ns != 0 && w.src == top.src;     /* deltas need the same source */
+    w.scan = top.scans++;
+    w.now = now_ns();
+    tape_value("now", &w.now, sizeof(w.now));
+    w.old = top.procs[top.cur];
+    w.cur = top.procs[top.cur ^ 1];
+    w.n = w.fds = 0;
+
+    int newest = top_newest_pid();
+    if (!w.primed || newest < 0 || newest != walked_newest) {
+        char ents[8192] __attribute__((aligned(8)));
+        ssize_t got;
+        if (!tape_replaying()) lseek(top.dir, 0, SEEK_SET);
+        count_syscalls(1);
+        while ((got = top_getdents(ents, sizeof(ents))) > 0) {
+            for (ssize_t off = 0; off < got;) {
+                const struct dirent64 *d = (const struct dirent64 *)(ents + off);
+                off += d->d_reclen;
+                if (d->d_name[0] >= '1' && d->d_name[0] <= '9') top_visit(&w, atoi(d->d_name));
+            }
+        }
+        walked_newest = newest;
+    } else {
+        for (int i = 0; i < top.count[top.cur]; ++i) top_visit(&w, w.old[i].pid);
+    }
+
+    for (int i = 0; i < top.count[top.cur]; ++i) {
+        if (w.old[i].fd >= 0) top_close(w.old[i].fd);
+    }
+    top.count[top.cur ^ 1] = w.n;
+    top.cur ^= 1;
+    top.src = w.src;
+    top_rehash();
+    top.scanned_ns = w.now;
+    stat_inc(&self_stats.top_scans);
+    return w.n > 0 ? 0 : -1;
+}
+
+static int top_format(struct top_heap *h, int by_mem, char *out, size_t outlen) {
+    /* heap order to descending */
+    int order[TOP_MAX], m = h->n;
+    for (int i = 0; i < m; ++i) order[i] = i;
+    for (int i = 1; i < m; ++i)
+        for (int j = i; j > 0 && h->key[order[j]] > h->key[order[j - 1]]; --j) {
+            int tmp = order[j];
+            order[j] = order[j - 1];
+            order[j - 1] = tmp;
+        }
+
+    struct text t = TEXT(out, outlen);
+    const struct proc *procs = top.procs[top.cur];
+    for (int i = 0; i < m; ++i) {
+        const struct proc *p = &procs[h->idx[order[i]]];
+        char buf[512 + 8], comm[16] = "?";
+        unsigned long long ticks;
+        long long rss;
+        int fd = top_open(p->pid, "stat");
+        if (fd >= 0) {
+            ssize_t len = top_pread(fd, buf, sizeof(buf) - 8 - 1);
+            top_close(fd);
+            if (len > 0) {
+                buf[len] = '\0';
+                proc_stat_parse(buf, (size_t)len, comm, sizeof(comm), &ticks, &rss);
+            }
+        }
+        if (i) text_str(&t, " ");
+        text_str(&t, comm);
+        text_str(&t, " ");
+        if (by_mem) {
+            text_size(&t, p->rss_kib);
+        } else {
+            text_num(&t, p->pct < 0 ? 0 : p->pct, 2);
+            text_str(&t, "%");
+        }
+    }
+    text_end(&t);
+    return !by_mem && m ? level_for(h->key[order[0]], CPU_WARN, CPU_CRIT) : LEVEL_OK;
+}
+
+static int get_top_now(char *out, size_t outlen) {
+    int count = __atomic_load_n(&cfg.top_count, __ATOMIC_RELAXED);
+    int by_mem = __atomic_load_n(&cfg.top_by_mem, __ATOMIC_RELAXED);
+    struct top_heap h = { 0, count < 1 ? 1 : count > TOP_MAX ? TOP_MAX : count, {0}, {0} };
+    long long t0 = now_ns();
+    if (top_scan(&h, by_mem) != 0) {
+        snprintf(out, outlen, "N/A");
+        return -1;
+    }
+    int rc = top_format(&h, by_mem, out, outlen);
+    top.cost_ns = now_ns() - t0;
+    str_copy(top.last, sizeof(top.last), out);
+    top.last_rc = rc;
+    return rc;
+}
+
+/* the budget, not the interval, decides on a box with thousands of processes */
+static int get_top(char *out, size_t outlen) {
+    int skip = 0;
+    if (!tape_replaying()) skip = top.last[0] && now_ns() - top.scanned_ns < top.cost_ns * TOP_BUDGET;
+    tape_value("top skip", &skip, sizeof(skip));
+    if (skip) {
+        stat_inc(&self_stats.top_skips);
+        str_copy(out, outlen, top.last);
+        return top.last_rc;
+    }
+    return get_top_now(out, outlen);
+}
+
+/* ---------- Net via rtnetlink ---------- */
+
+/* a netlink request socket, opened on first use. Each belongs to one
+   collector, which runs on one worker at a time, so its buffer needs no lock */
+struct nl_sock {
+    int fd;
+    int proto;
+    uint32_t seq;
+    unsigned long *errors;      /* self_stats counter */
+    char buf[16384] __attribute__((aligned(NLMSG_ALIGNTO)));
+};
+
+static struct {
+    struct nl_sock nl;          /* NETLINK_ROUTE */
+    int ifindex;                /* 0 = unresolved */
+    int resolve;                /* re-run interface selection before the next sample */
+    int have_getstats;          /* RTM_GETSTATS supported (4.7+), else RTM_GETLINK */
+    struct rate_clock clock;    /* when prev_* were read */
+    unsigned long long prev_rx, prev_tx;
+    struct series rx_hist, tx_hist;     /* KiB/s */
+} net = { { -1, NETLINK_ROUTE, 0, &self_stats.rtnl_errors, "" }, 0, 1, 1, {}, 0, 0, {}, {} };
+
+typedef int (*nl_cb)(const struct nlmsghdr *nh, void *arg);
+
+/* send one request and hand every reply to cb; dumps run until NLMSG_DONE,
+   plain requests stop at the first answer. Returns 0 or -errno */
+static int nl_talk(struct nl_sock *s, struct nlmsghdr *req, nl_cb cb, void *arg) {
+    if (s->fd < 0) {
+        s->fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, s->proto);
+        count_syscalls(1);
+        if (s->fd < 0) {
+            stat_inc(s->errors);
+            return -errno;
+        }
+    }
+
+    req->nlmsg_seq = ++s->seq;
+    struct sockaddr_nl kernel;
+    memset(&kernel, 0, sizeof(kernel));
+    kernel.nl_family = AF_NETLINK;
+    count_syscalls(1);
+    if (sendto(s->fd, req, req->nlmsg_len, 0, (struct sockaddr *)&kernel, sizeof(kernel)) < 0) {
+        stat_inc(s->errors);
+        return -errno;
+    }
+
+    int dump = (req->nlmsg_flags & NLM_F_DUMP) != 0;
+    for (;;) {
+        ssize_t n = recv(s->fd, s->buf, sizeof(s->buf), 0);
+        count_syscalls(1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            stat_inc(s->errors);
+            return -errno;
+        }
+        for (struct nlmsghdr *nh = (struct nlmsghdr *)s->buf; NLMSG_OK(nh, (size_t)n);
+             nh = NLMSG_NEXT(nh, n)) {
+            if (nh->nlmsg_seq != s->seq) continue;
+            if (nh->nlmsg_type == NLMSG_DONE) return 0;
+            if (nh->nlmsg_type == NLMSG_ERROR) {
+                const struct nlmsgerr *e = (const struct nlmsgerr *)NLMSG_DATA(nh);
+                if (e->error) stat_inc(s->errors);
+                return e->error;
+            }
+            cb(nh, arg);
+            if (!dump) return 0;
+        }
+    }
+}
+
+static int rtnl_talk(struct nlmsghdr *req, nl_cb cb, void *arg) {
+    return nl_talk(&net.nl, req, cb, arg);
+}
+
+struct route_pick {
+    int oif;
+    uint32_t metric;
+};
+
+static int route_cb(const struct nlmsghdr *nh, void *arg) {
+    struct route_pick *pick = (struct route_pick *)arg;
+    if (nh->nlmsg_type != RTM_NEWROUTE) return 0;
+    const struct rtmsg *rt = (const struct rtmsg *)NLMSG_DATA(nh);
+    if (rt->rtm_dst_len != 0 || rt->rtm_type != RTN_UNICAST) return 0;
+
+    uint32_t table = rt->rtm_table, metric = 0;
+    int oif = 0;
+    int len = (int)RTM_PAYLOAD(nh);
+    for (const struct rtattr *a = RTM_RTA(rt); RTA_OK(a, len); a = RTA_NEXT(a, len)) {
+        if (a->rta_type == RTA_TABLE) table = *(const uint32_t *)RTA_DATA(a);
+        else if (a->rta_type == RTA_OIF) oif = *(const int *)RTA_DATA(a);
+        else if (a->rta_type == RTA_PRIORITY) metric = *(const uint32_t *)RTA_DATA(a);
+    }
+    if (table != RT_TABLE_MAIN || oif == 0) return 0;
+    if (pick->oif == 0 || metric < pick->metric) {
+        pick->oif = oif;
+        pick->metric = metric;
+    }
+    return 0;
+}
+
+/* interface of the lowest-metric default route, IPv4 first then IPv6 */
+static int default_route_ifindex(void) {
+    static const unsigned char families[] = { AF_INET, AF_INET6 };
+    for (size_t i = 0; i < sizeof(families); ++i) {
+        struct {
+            struct nlmsghdr nh;
+            struct rtmsg rt;
+        } req;
+        memset(&req, 0, sizeof(req));
+        req.nh.nlmsg_len = NLMSG_LENGTH(sizeof(req.rt));
+        req.nh.nlmsg_type = RTM_GETROUTE;
+        req.nh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+        req.rt.rtm_family = families[i];
+
+        struct route_pick pick = { 0, 0 };
+        if (rtnl_talk(&req.nh, route_cb, &pick) == 0 && pick.oif) return pick.oif;
+    }
+    return 0;
+}
+
+static void net_resolve(void) {
+    char iface[CFG_STR];
+    cfg_get(iface, sizeof(iface), cfg.net_iface);
+    int ifindex = 0;
+    if (!tape_replaying()) ifindex = iface[0] ? (int)if_nametoindex(iface) : default_route_ifindex();
+    tape_value("ifindex", &ifindex, sizeof(ifindex));
+    __atomic_store_n(&net.ifindex, ifindex, __ATOMIC_RELAXED);
+    net.clock.primed = 0;               /* new interface: next sample is a baseline */
+}
+
+struct link_counters {
+    int found;
+    unsigned long long rx, tx;
+};
+
+static void counters_from(struct link_counters *c, const struct rtattr *a) {
+    struct rtnl_link_stats64 st;
+    memcpy(&st, RTA_DATA(a), sizeof(st));
+    c->rx = st.rx_bytes;
+    c->tx = st.tx_bytes;
+    c->found = 1;
+}
+
+static int stats_cb(const struct nlmsghdr *nh, void *arg) {
+    struct link_counters *c = (struct link_counters *)arg;
+    int len;
+    const struct rtattr *a;
+    if (nh->nlmsg_type == RTM_NEWSTATS) {
+        len = (int)(nh->nlmsg_len - NLMSG_LENGTH(sizeof(struct if_stats_msg)));
+        a = (const struct rtattr *)((const char *)NLMSG_DATA(nh) +
+                                    NLMSG_ALIGN(sizeof(struct if_stats_msg)));
+    } else if (nh->nlmsg_type == RTM_NEWLINK) {
+        len = (int)IFLA_PAYLOAD(nh);
+        a = IFLA_RTA((const struct ifinfomsg *)NLMSG_DATA(nh));
+    } else {
+        return 0;
+    }
+    for (; RTA_OK(a, len); a = RTA_NEXT(a, len)) {
+        unsigned short type = a->rta_type;
+        if ((nh->nlmsg_type == RTM_NEWSTATS && type == IFLA_STATS_LINK_64) ||
+            (nh->nlmsg_type == RTM_NEWLINK && type == IFLA_STATS64)) {
+            if (RTA_PAYLOAD(a) >= sizeof(struct rtnl_link_stats64)) counters_from(c, a);
+        }
+    }
+    return 0;
+}
+
+/* binary 64-bit counters for one ifindex: constant cost however many links exist */
+static int net_read_counters(int ifindex, struct link_counters *c) {
+    c->found = 0;
+    if (net.have_getstats) {
+        struct {
+            struct nlmsghdr nh;
+            struct if_stats_msg ifsm;
+        } req;
+        memset(&req, 0, sizeof(req));
+        req.nh.nlmsg_len = NLMSG_LENGTH(sizeof(req.ifsm));
+        req.nh.nlmsg_type = RTM_GETSTATS;
+        req.nh.nlmsg_flags = NLM_F_REQUEST;
+        req.ifsm.ifindex = (uint32_t)ifindex;
+        req.ifsm.filter_mask = IFLA_STATS_FILTER_BIT(IFLA_STATS_LINK_64);
+
+        int err = rtnl_talk(&req.nh, stats_cb, c);
+        if (err == -EOPNOTSUPP || err == -EINVAL) net.have_getstats = 0;
+        else return c->found ? 0 : -1;
+    }
+
+    struct {
+        struct nlmsghdr nh;
+        struct ifinfomsg ifi;
+    } req;
+    memset(&req, 0, sizeof(req));
+    req.nh.nlmsg_len = NLMSG_LENGTH(sizeof(req.ifi));
+    req.nh.nlmsg_type = RTM_GETLINK;
+    req.nh.nlmsg_flags = NLM_F_REQUEST;
+    req.ifi.ifi_family = AF_UNSPEC;
+    req.ifi.ifi_index = ifindex;
+    rtnl_talk(&req.nh, stats_cb, c);
+    return c->found ? 0 : -1;
+}
+
+static int net_format(char *out, size_t outlen) {
+    struct text t = TEXT(out, outlen);
+    text_str(&t, "↓");
+    text_num(&t, (long long)(net.rx_hist.ewma + 0.5), 5);
+    text_str(&t, " KiB/s ↑");
+    text_num(&t, (long long)(net.tx_hist.ewma + 0.5), 4);
+    text_str(&t, " KiB/s");
+    text_end(&t);
+    if (SPARK_WIDTH) {
+        text_str(&t, " ");
+        series_spark(&net.rx_hist, out, t.len, outlen, SPARK_WIDTH, 0);
+    }
+    int rx = level_for((long long)net.rx_hist.ewma, NET_WARN_KIB, NET_CRIT_KIB);
+    int tx = level_for((long long)net.tx_hist.ewma, NET_WARN_KIB, NET_CRIT_KIB);
+    return rx > tx ? rx : tx;
+}
+
+static int get_net_speed(char *out, size_t outlen) {
+    if (flag_take(&net.resolve)) net_resolve();
+
+    struct link_counters c = { 0, 0, 0 };
+    if (net.ifindex <= 0) {
+        flag_raise(&net.resolve);
+        snprintf(out, outlen, "↓    - KiB/s ↑   - KiB/s");
+        return 0;
+    }
+    int err = -1;
+    if (!tape_replaying()) err = net_read_counters(net.ifindex, &c);
+    tape_value("link", &c, sizeof(c));
+    tape_value("link rc", &err, sizeof(err));
+    if (err != 0) {
+        flag_raise(&net.resolve);
+        snprintf(out, outlen, "↓    - KiB/s ↑   - KiB/s");
+        return -1;
+    }
+    long long awake = rate_tick(&net.clock);
+    if (awake < 0) return net_format(out, outlen);
+
+    /* a sample spanning a suspend or a counter reset says nothing about the
+       current rate: re-baseline and keep showing the last one */
+    long long rx = awake ? rate_kib(net.prev_rx, c.rx, awake) : -1;
+    long long tx = awake ? rate_kib(net.prev_tx, c.tx, awake) : -1;
+    if (rx >= 0 && tx >= 0) {
+        series_push(&net.rx_hist, rx, NET_EWMA_ALPHA);
+        series_push(&net.tx_hist, tx, NET_EWMA_ALPHA);
+    }
+    net.prev_rx = c.rx;
+    net.prev_tx = c.tx;
+    return net_format(out, outlen);
+}
+
+/* ---------- Wi-Fi via nl80211 ---------- */
+
+/* nl80211 is a generic netlink family: its id and those of its multicast
+   groups are looked up by name from the controller */
+struct genl_req {
+    struct nlmsghdr nh;
+    struct genlmsghdr gh;
+    char attrs[64];
+};
+
+static void genl_init(struct genl_req *r, uint16_t family, uint8_t cmd, uint16_t flags) {
+    memset(r, 0, sizeof(*r));
+    r->nh.nlmsg_len = NLMSG_LENGTH(GENL_HDRLEN);
+    r->nh.nlmsg_type = family;
+    r->nh.nlmsg_flags = NLM_F_REQUEST | flags;
+    r->gh.cmd = cmd;
+    r->gh.version = 1;
+}
+
+/* struct nlattr has the layout of struct rtattr, so the RTA_* macros build and walk both */
+static void genl_put(struct genl_req *r, uint16_t type, const void *data, size_t len) {
+    struct rtattr *a = (struct rtattr *)((char *)r + NLMSG_ALIGN(r->nh.nlmsg_len));
+    a->rta_type = type;
+    a->rta_len = (unsigned short)RTA_LENGTH(len);
+    memcpy(RTA_DATA(a), data, len);
+    r->nh.nlmsg_len = NLMSG_ALIGN(r->nh.nlmsg_len) + RTA_ALIGN(a->rta_len);
+}
+
+#define GENL_ATTRS(nh) ((const struct rtattr *)((const char *)NLMSG_DATA(nh) + GENL_HDRLEN))
+#define GENL_ATTRLEN(nh) ((int)((nh)->nlmsg_len - NLMSG_LENGTH(GENL_HDRLEN)))
+#define NLA_KIND(a) ((a)->rta_type & NLA_TYPE_MASK)
+
+struct nl80211_ids {
+    int family;
+    uint32_t mlme, config;      /* multicast groups, 0 = not offered */
+};
+
+static int family_cb(const struct nlmsghdr *nh, void *arg) {
+    struct nl80211_ids *ids = (struct nl80211_ids *)arg;
+    if (nh->nlmsg_type != GENL_ID_CTRL) return 0;
+    int len = GENL_ATTRLEN(nh);
+    for (const struct rtattr *a = GENL_ATTRS(nh); RTA_OK(a, len); a = RTA_NEXT(a, len)) {
+        if (NLA_KIND(a) == CTRL_ATTR_FAMILY_ID) {
+            ids->family = *(const uint16_t *)RTA_DATA(a);
+            continue;
+        }
+        if (NLA_KIND(a) != CTRL_ATTR_MCAST_GROUPS) continue;
+        int glen = (int)RTA_PAYLOAD(a);
+        for (const struct rtattr *g = (const struct rtattr *)RTA_DATA(a); RTA_OK(g, glen);
+             g = RTA_NEXT(g, glen)) {
+            const char *name = "";
+            uint32_t id = 0;
+            int flen = (int)RTA_PAYLOAD(g);
+            for (const struct rtattr *f = (const struct rtattr *)RTA_DATA(g); RTA_OK(f, flen);
+                 f = RTA_NEXT(f, flen)) {
+                if (NLA_KIND(f) == CTRL_ATTR_MCAST_GRP_NAME) name = (const char *)RTA_DATA(f);
+                else if (NLA_KIND(f) == CTRL_ATTR_MCAST_GRP_ID) id = *(const uint32_t *)RTA_DATA(f);
+            }
+            if (strcmp(name, NL80211_MULTICAST_GROUP_MLME) == 0) ids->mlme = id;
+            else if (strcmp(name, NL80211_MULTICAST_GROUP_CONFIG) == 0) ids->config = id;
+        }
+    }
+    return 0;
+}
+
+/* -ENOENT while cfg80211 is not loaded */
+static int nl80211_lookup(struct nl_sock *s, struct nl80211_ids *ids) {
+    struct genl_req req;
+    genl_init(&req, GENL_ID_CTRL, CTRL_CMD_GETFAMILY, 0);
+    genl_put(&req, CTRL_ATTR_FAMILY_NAME, NL80211_GENL_NAME, sizeof(NL80211_GENL_NAME));
+    memset(ids, 0, sizeof(*ids));
+    int err = nl_talk(s, &req.nh, family_cb, ids);
+    return err ? err : ids->family ? 0 : -ENOENT;
+}
+
+#define SSID_MAX 32
+
+static struct {
+    struct nl_sock nl;          /* NETLINK_GENERIC */
+    int family;                 /* nl80211's id, 0 = not looked up yet */
+    int resolve;                /* re-pick the interface and re-read its SSID before the next sample */
+    int ifindex;                /* station interface sampled, 0 = none */
+    int follows;                /* net.ifindex the pick was made for */
+    int associated;             /* the last sample found an AP */
+    char ssid[SSID_MAX + 1];
+} wifi = { { -1, NETLINK_GENERIC, 0, &self_stats.genl_errors, "" }, 0, 1, 0, 0, 0, "" };
+
+enum { WIFI_NONE, WIFI_DOWN, WIFI_UP };
+
+/* one sample: what is recorded and replayed */
+struct wifi_link {
+    int state;
+    int dbm;                    /* signal of the AP, 0 = not reported */
+    unsigned rate;              /* TX bitrate in 100 kbit/s, 0 = not reported */
+    char ssid[SSID_MAX + 1];
+};
+
+struct iface_pick {
+    int want;                   /* preferred ifindex, taken if it is a station */
+    int ifindex;
+    char ssid[SSID_MAX + 1];
+};
+
+static int iface_cb(const struct nlmsghdr *nh, void *arg) {
+    struct iface_pick *pick = (struct iface_pick *)arg;
+    if (nh->nlmsg_type != wifi.family) return 0;
+    int ifindex = 0, station = 0;
+    const struct rtattr *ssid = NULL;
+    int len = GENL_ATTRLEN(nh);
+    for (const struct rtattr *a = GENL_ATTRS(nh); RTA_OK(a, len); a = RTA_NEXT(a, len)) {
+        if (NLA_KIND(a) == NL80211_ATTR_IFINDEX) ifindex = *(const int *)RTA_DATA(a);
+        else if (NLA_KIND(a) == NL80211_ATTR_IFTYPE)
+            station = *(const uint32_t *)RTA_DATA(a) == NL80211_IFTYPE_STATION;
+        else if (NLA_KIND(a) == NL80211_ATTR_SSID) ssid = a;
+    }
+    if (!station || (pick->ifindex && ifindex != pick->want)) return 0;
+    pick->ifindex = ifindex;
+    pick->ssid[0] = '\0';
+    if (ssid) {
+        size_t n = RTA_PAYLOAD(ssid) < SSID_MAX ? RTA_PAYLOAD(ssid) : SSID_MAX;
+        memcpy(pick->ssid, RTA_DATA(ssid), n);
+        pick->ssid[n] = '\0';
+    }
+    return 0;
+}
+
+/* the interface the Net field measures when it is a station (the pinned
+   one, or whichever carries the default route), else the first station */
+static void wifi_resolve(int follows) {
+    char iface[CFG_STR];
+    cfg_get(iface, sizeof(iface), cfg.net_iface);
+    struct iface_pick pick;
+    memset(&pick, 0, sizeof(pick));
+    pick.want = iface[0] ? (int)if_nametoindex(iface) : follows;
+
+    struct genl_req req;
+    genl_init(&req, (uint16_t)wifi.family, NL80211_CMD_GET_INTERFACE, NLM_F_DUMP);
+    if (nl_talk(&wifi.nl, &req.nh, iface_cb, &pick) < 0) flag_raise(&wifi.resolve);
+    __atomic_store_n(&wifi.ifindex, pick.ifindex, __ATOMIC_RELAXED);
+    wifi.follows = follows;
+    memcpy(wifi.ssid, pick.ssid, sizeof(wifi.ssid));
+}
+
+static int station_cb(const struct nlmsghdr *nh, void *arg) {
+    struct wifi_link *l = (struct wifi_link *)arg;
+    if (nh->nlmsg_type != wifi.family) return 0;
+    int len = GENL_ATTRLEN(nh);
+    for (const struct rtattr *a = GENL_ATTRS(nh); RTA_OK(a, len); a = RTA_NEXT(a, len)) {
+        if (NLA_KIND(a) != NL80211_ATTR_STA_INFO) continue;
+        l->state = WIFI_UP;
+        int ilen = (int)RTA_PAYLOAD(a);
+        for (const struct rtattr *i = (const struct rtattr *)RTA_DATA(a); RTA_OK(i, ilen);
+             i = RTA_NEXT(i, ilen)) {
+            if (NLA_KIND(i) == NL80211_STA_INFO_SIGNAL) {
+                l->dbm = *(const int8_t *)RTA_DATA(i);
+                continue;
+            }
+            if (NLA_KIND(i) != NL80211_STA_INFO_TX_BITRATE) continue;
+            int rlen = (int)RTA_PAYLOAD(i);
+            for (const struct rtattr *r = (const struct rtattr *)RTA_DATA(i); RTA_OK(r, rlen);
+                 r = RTA_NEXT(r, rlen)) {
+                if (NLA_KIND(r) == NL80211_RATE_INFO_BITRATE32) l->rate = *(const uint32_t *)RTA_DATA(r);
+                else if (NLA_KIND(r) == NL80211_RATE_INFO_BITRATE && !l->rate)
+                    l->rate = *(const uint16_t *)RTA_DATA(r);
+            }
+        }
+    }
+    return 0;
+}
+
+/* signal and bitrate are read every interval; the interface and SSID only
+   when an nl80211 or link event (or a change of the Net interface) says
+   they may have moved */
+static int wifi_sample(struct wifi_link *l, int resolve) {
+    if (!wifi.family) {
+        if (!resolve) return 0;         /* no nl80211 yet: retried when a link appears */
+        struct nl80211_ids ids;
+        int err = nl80211_lookup(&wifi.nl, &ids);
+        if (err) return err == -ENOENT ? 0 : -1;
+        wifi.family = ids.family;
+        resolve = 1;
+    }
+    int follows = __atomic_load_n(&net.ifindex, __ATOMIC_RELAXED);
+    if (resolve || follows != wifi.follows) wifi_resolve(follows);
+    if (!wifi.ifindex) return 0;
+
+    struct genl_req req;
+    genl_init(&req, (uint16_t)wifi.family, NL80211_CMD_GET_STATION, NLM_F_DUMP);
+    genl_put(&req, NL80211_ATTR_IFINDEX, &wifi.ifindex, sizeof(wifi.ifindex));
+    l->state = WIFI_DOWN;
+    int err = nl_talk(&wifi.nl, &req.nh, station_cb, l);
+    if (err == -ENODEV) {
+        l->state = WIFI_NONE;
+        flag_raise(&wifi.resolve);
+        return 0;
+    }
+    if (err) return -1;
+    if (l->state == WIFI_UP && !wifi.associated && !resolve) wifi_resolve(follows);    /* fresh SSID */
+    wifi.associated = l->state == WIFI_UP;
+    memcpy(l->ssid, wifi.ssid, sizeof(l->ssid));
+    return 0;
+}
+
+static int get_wifi(char *out, size_t outlen) {
+    struct wifi_link l;
+    memset(&l, 0, sizeof(l));
+    int resolve = flag_take(&wifi.resolve);
+    int err = 0;
+    if (!tape_replaying()) err = wifi_sample(&l, resolve);
+    tape_value("wifi", &l, sizeof(l));
+    tape_value("wifi rc", &err, sizeof(err));
+    if (err) {
+        snprintf(out, outlen, "N/A");
+        return -1;
+    }
+    struct text t = TEXT(out, outlen);
+    if (l.state == WIFI_NONE) text_str(&t, "N/A");
+    else if (l.state == WIFI_DOWN) text_str(&t, "down");
+    if (l.state != WIFI_UP) {
+        text_end(&t);
+        return LEVEL_OK;
+    }
+    for (char *c = l.ssid; *c; ++c)
+        if ((unsigned char)*c < 0x20 || *c == 0x7f) *c = '?';
+    text_str(&t, l.ssid[0] ? l.ssid : "?");
+    if (l.dbm) {
+        text_str(&t, " ");
+        text_num(&t, l.dbm, 3);
+        text_str(&t, "dBm");
+    }
+    if (l.rate) {
+        text_str(&t, " ");
+        text_num(&t, (l.rate + 5) / 10, 4);
+        text_str(&t, "Mb/s");
+    }
+    text_end(&t);
+    return l.dbm ? level_for(-l.dbm, -WIFI_WARN_DBM, -WIFI_CRIT_DBM) : LEVEL_OK;
+}
+
+/* ---------- Temp ---------- */
+
+#define TEMP_MAX_SENSORS 32
+
+/* one temp*_input found under /sys/class/hwmon, kept open between samples */
+struct temp_sensor {
+    char chip[32];              /* hwmonN/name, e.g. coretemp */
+    char label[32];             /* tempN_label, e.g. Package id 0; empty if absent */
+    char path[80];
+    struct source src;
+};
+
+/* sensor table; rebuilt on hwmon hotplug or when a read fails */
+static struct {
+    int rescan;
+    int count;
+    struct temp_sensor sensors[TEMP_MAX_SENSORS];
+    char want[CFG_STR];         /* cfg.temp_sensor as of the last probe */
+} temp_cache = { 1, 0, {}, {0} };
+
+/* read a small sysfs attribute once, without keeping it open */
+static void read_attr(const char *path, char *buf, size_t buflen) {
+    struct source src = SOURCE(path);
+    source_read(&src, buf, buflen);
+    source_close(&src);
+    trim_newline(buf);
+}
+
+static int temp_selected(const struct temp_sensor *t) {
+    const char *want = temp_cache.want;
+    if (!want[0]) return 1;
+    if (strcmp(t->label, want) == 0 || strcmp(t->chip, want) == 0) return 1;
+    char full[sizeof(t->chip) + sizeof(t->label) + 1];
+    snprintf(full, sizeof(full), "%s/%s", t->chip, t->label);
+    return strcmp(full, want) == 0;
+}
+
+static void temp_scan_chip(const char *dir) {
+    char path[80], chip[32];
+    snprintf(path, sizeof(path), "/sys/class/hwmon/%.16s/name", dir);
+    read_attr(path, chip, sizeof(chip));
+
+    snprintf(path, sizeof(path), "/sys/class/hwmon/%.16s", dir);
+    char names[4096];
+    dir_list(path, names, sizeof(names));
+
+    for (const char *name = names; *name && temp_cache.count < TEMP_MAX_SENSORS; name += strlen(name) + 1) {
+        int idx;
+        char tail[8];
+        if (sscanf(name, "temp%d_%7s", &idx, tail) != 2 || strcmp(tail, "input") != 0)
+            continue;
+
+        struct temp_sensor *t = &temp_cache.sensors[temp_cache.count];
+        snprintf(t->chip, sizeof(t->chip), "%s", chip);
+        snprintf(path, sizeof(path), "/sys/class/hwmon/%.16s/temp%d_label", dir, idx);
+        read_attr(path, t->label, sizeof(t->label));
+        if (!temp_selected(t)) continue;
+
+        snprintf(t->path, sizeof(t->path), "/sys/class/hwmon/%.16s/%.24s", dir, name);
+        t->src.path = t->path;
+        if (source_open(&t->src) < 0) continue;
+        temp_cache.count++;
+    }
+}
+
+/* enumerate the sensors that actually exist instead of guessing hwmonN/tempN paths */
+static void temp_probe(void) {
+    for (int k = 0; k < temp_cache.count; ++k) source_close(&temp_cache.sensors[k].src);
+    temp_cache.count = 0;
+    stat_inc(&self_stats.hwmon_rescans);
+    cfg_get(temp_cache.want, sizeof(temp_cache.want), cfg.temp_sensor);
+
+    char names[1024];
+    dir_list("/sys/class/hwmon", names, sizeof(names));
+    for (const char *name = names; *name && temp_cache.count < TEMP_MAX_SENSORS; name += strlen(name) + 1) {
+        if (strncmp(name, "hwmon", 5) != 0) continue;
+        temp_scan_chip(name);
+    }
+}
+
+static int get_temp(char *out, size_t outlen) {
+    if (flag_take(&temp_cache.rescan)) temp_probe();
+
+    int max_temp = 0;
+    char buf[32];
+    for (int k = 0; k < temp_cache.count; ++k) {
+        if (source_read(&temp_cache.sensors[k].src, buf, sizeof(buf)) <= 0) {
+            flag_raise(&temp_cache.rescan);     /* sensor vanished: re-probe next sample */
+            continue;
+        }
+        int t = atoi(buf);
+        if (t > 1000000) t /= 1000000;
+        else if (t > 1000) t /= 1000;
+        if (t > 0 && t < 150 && t > max_temp) max_temp = t;
+    }
+    if (max_temp <= 0) {
+        snprintf(out, outlen, "N/A");
+        return -1;
+    }
+    struct text t = TEXT(out, outlen);
+    text_num(&t, max_temp, 3);
+    text_str(&t, "°C");
+    text_end(&t);
+    return 0;
+}
+
+/* ---------- Battery via /sys/class/power_supply ---------- */
+
+#define SUPPLY_MAX 6
+#define BATT_EWMA_ALPHA 0.3     /* weight of the newest power sample in the time estimate */
+
+enum { BAT_STATUS, BAT_CAPACITY, BAT_NOW, BAT_FULL, BAT_POWER, BAT_VOLTAGE, BAT_ATTRS };
+
+/* charge_* batteries report uAh and uA; with voltage_now they are converted
+   so that every battery adds up in uWh and uW */
+static const char *const bat_attr[2][BAT_ATTRS] = {
+    { "status", "capacity", "energy_now", "energy_full", "power_now", "voltage_now" },
+    { "status", "capacity", "charge_now", "charge_full", "current_now", "voltage_now" },
+};
+
+struct supply {
+    int ac;                     /* a Mains/USB adapter: attr[0] is "online" */
+    int charge;                 /* reports charge_* rather than energy_* */
+    char path[BAT_ATTRS][96];
+    struct source attr[BAT_ATTRS];
+};
+
+/* found once, and again on power_supply add/remove uevents or a read failure */
+static struct {
+    int rescan;
+    int count;
+    struct supply s[SUPPLY_MAX];
+    int dir;                    /* 1 charging, -1 discharging, 0 idle: what uw belongs to */
+    double uw;                  /* smoothed power, 0 = unknown */
+    struct rate_clock clock;    /* for batteries without power_now */
+    long long prev_uwh;
+    int on_battery;             /* discharging with no adapter online, for the governor */
+} batt = { 1, 0, {}, 0, 0.0, {}, 0, 0 };
+
+static int source_ll(struct source *src, long long *v) {
+    char buf[32];
+    *v = 0;
+    if (source_read(src, buf, sizeof(buf)) <= 0) return -1;
+    *v = atoll(buf);
+    return 0;
+}
+
+static void supply_add(const char *name, int ac) {
+    struct supply *sp = &batt.s[batt.count];
+    char path[80], value[16];
+    snprintf(path, sizeof(path), "/sys/class/power_supply/%.32s/energy_now", name);
+    read_attr(path, value, sizeof(value));
+    sp->ac = ac;
+    sp->charge = !ac && !value[0];
+    for (int k = 0; k < BAT_ATTRS; ++k) {
+        const char *attr = ac ? (k == 0 ? "online" : NULL) : bat_attr[sp->charge][k];
+        sp->attr[k].fd = -1;
+        sp->attr[k].path = NULL;
+        if (!attr) continue;
+        snprintf(sp->path[k], sizeof(sp->path[k]), "/sys/class/power_supply/%.32s/%s", name, attr);
+        sp->attr[k].path = sp->path[k];
+    }
+    batt.count++;
+}
+
+static void batt_probe(void) {
+    for (int i = 0; i < batt.count; ++i)
+        for (int k = 0; k < BAT_ATTRS; ++k) source_close(&batt.s[i].attr[k]);
+    batt.count = 0;
+    batt.dir = 0;
+    batt.uw = 0;
+    batt.clock.primed = 0;
+
+    char want[CFG_STR], names[1024];
+    cfg_get(want, sizeof(want), cfg.battery);
+    dir_list("/sys/class/power_supply", names, sizeof(names));
+    for (const char *name = names; *name && batt.count < SUPPLY_MAX; name += strlen(name) + 1) {
+        if (name[0] == '.') continue;
+        char path[80], type[16], scope[16];
+        snprintf(path, sizeof(path), "/sys/class/power_supply/%.32s/type", name);
+        read_attr(path, type, sizeof(type));
+        snprintf(path, sizeof(path), "/sys/class/power_supply/%.32s/scope", name);
+        read_attr(path, scope, sizeof(scope));
+        if (!type[0])       /* older kernels and fixtures: go by the usual names */
+            snprintf(type, sizeof(type), "%s", strncmp(name, "BAT", 3) == 0 ? "Battery" :
+                     strncmp(name, "AC", 2) == 0 || strncmp(name, "ADP", 3) == 0 ? "Mains" : "");
+
+        if (strcmp(type, "Mains") == 0 || strcmp(type, "USB") == 0) {
+            supply_add(name, 1);
+        } else if (strcmp(type, "Battery") == 0 && strcmp(scope, "Device") != 0 &&
+                   (!want[0] || strcmp(want, name) == 0)) {
+            supply_add(name, 0);      /* scope=Device is a mouse or headset, not ours */
+        }
+    }
+}
+
+static int get_battery(char *out, size_t outlen) {
+    if (flag_take(&batt.rescan)) batt_probe();
+
+    int bats = 0, charging = 0, discharging = 0, full = 0, online = 0, cap_sum = 0;
+    long long uwh = 0, uwh_full = 0, uw = 0;
+    for (int i = 0; i < batt.count; ++i) {
+        struct supply *sp = &batt.s[i];
+        if (sp->ac) {
+            long long on;
+            online |= source_ll(&sp->attr[0], &on) == 0 && on > 0;
+            continue;
+        }
+        char status[32];
+        if (source_read(&sp->attr[BAT_STATUS], status, sizeof(status)) <= 0) {
+            flag_raise(&batt.rescan);       /* battery pulled: re-probe next sample */
+            continue;
+        }
+        bats++;
+        charging += strncmp(status, "Charging", 8) == 0;
+        discharging += strncmp(status, "Discharging", 11) == 0;
+        full += strncmp(status, "Full", 4) == 0;
+        long long cap, now, top, pw, uv;
+        source_ll(&sp->attr[BAT_CAPACITY], &cap);
+        cap_sum += cap > 0 ? (int)cap : 0;
+
+        source_ll(&sp->attr[BAT_NOW], &now);
+        source_ll(&sp->attr[BAT_FULL], &top);
+        source_ll(&sp->attr[BAT_POWER], &pw);
+        if (pw < 0) pw = -pw;               /* some drivers sign current_now by direction */
+        if (sp->charge) {
+            source_ll(&sp->attr[BAT_VOLTAGE], &uv);
+            uv /= 1000;                     /* uAh * mV / 1000 = uWh */
+            now = now * uv / 1000;
+            top = top * uv / 1000;
+            pw = pw * uv / 1000;
+        }
+        if (now > 0 && top > 0) {
+            uwh += now;
+            uwh_full += top;
+        }
+        uw += pw > 0 ? pw : 0;
+    }
+    __atomic_store_n(&batt.on_battery, discharging > 0 && !online, __ATOMIC_RELAXED);
+    if (!bats) {
+        snprintf(out, outlen, online ? "AC" : "N/A N/A");
+        return online ? 0 : -1;
+    }
+
+    int dir = charging ? 1 : discharging ? -1 : 0;
+    if (dir != batt.dir) {                  /* plugged or unplugged: the old rate means nothing */
+        batt.dir = dir;
+        batt.uw = 0;
+        batt.clock.primed = 0;
+    }
+    if (!uw && uwh) {                       /* no power_now: derive it from the energy drop */
+        long long awake = rate_tick(&batt.clock);
+        if (awake > 0 && batt.prev_uwh > 0) {
+            long long moved = uwh > batt.prev_uwh ? uwh - batt.prev_uwh : batt.prev_uwh - uwh;
+            uw = (long long)((double)moved * 3600e9 / (double)awake);
+        }
+        if (awake >= 0) batt.prev_uwh = uwh;
+    }
+    if (uw > 0) batt.uw = batt.uw > 0 ? batt.uw + BATT_EWMA_ALPHA * ((double)uw - batt.uw) : (double)uw;
+
+    const char *state = charging ? "CHRG" : discharging ? "BATT" : full == bats ? "FULL" : "IDLE";
+    int pct = uwh_full > 0 ? (int)(uwh * 100 / uwh_full) : cap_sum / bats;
+    int n = snprintf(out, outlen, "%s %d%%", state, pct);
+
+    long long left = dir < 0 ? uwh : dir > 0 ? uwh_full - uwh : 0;
+    if (left > 0 && batt.uw > 0 && n > 0 && (size_t)n < outlen) {
+        long long mins = (long long)((double)left * 60 / batt.uw);
+        if (mins < 100 * 60) snprintf(out + n, outlen - (size_t)n, " %lld:%02lld", mins / 60, mins % 60);
+    }
+    return 0;
+}
+
+/* ---------- Audio via libpulse (persistent threaded mainloop, default sink, change events) ---------- */
+
+#define PA_RETRY_SEC 5
+
+/* written by PulseAudio callbacks under the mainloop lock; the reactor is
+   poked through an eventfd and re-renders the field */
+static struct {
+    pa_threaded_mainloop *ml;
+    pa_context *ctx;
+    int initialized;
+    int failed;                 /* context died; reactor tears down and retries */
+    char default_sink[256];
+    struct intellibar_slot vol;             /* written from the PulseAudio thread, read lock-free */
+    struct watch notify;        /* eventfd */
+    struct watch retry;         /* timerfd */
+} pa_handle = { NULL, NULL, 0, 0, {0}, { 0, {0, 0}, {"0%", "0%"} }, { -1, NULL }, { -1, NULL } };
+
+static void pa_notify(void) {
+    uint64_t one = 1;
+    ssize_t n = write(pa_handle.notify.fd, &one, sizeof(one));
+    (void)n;
+}
+
+/* callbacks: mainloop lock is already held by PulseAudio when these run */
+
+static void pa_sink_info_cb(pa_context *c, const pa_sink_info *i, int eol, void *userdata) {
+    (void)c;
+    (void)userdata;
+    if (eol || !i) return;
+
+    pa_volume_t v = pa_cvolume_avg(&i->volume);
+    int pct = (int)((100 * (long long)v) / PA_VOLUME_NORM);
+    if (pct < 0) pct = 0;
+    if (pct > 150) pct = 150;
+    char vol[16];
+    snprintf(vol, sizeof(vol), "%d%%", pct);
+    pub_write(&pa_handle.vol, 0, vol);
+    stat_inc(&self_stats.pa_updates);
+    pa_notify();
+}
+
+static void pa_request_sink(pa_context *c) {
+    pa_operation *op;
+    if (pa_handle.default_sink[0])
+        op = pa_context_get_sink_info_by_name(c, pa_handle.default_sink, pa_sink_info_cb, NULL);
+    else
+        op = pa_context_get_sink_info_list(c, pa_sink_info_cb, NULL);
+    if (op) pa_operation_unref(op);
+}
+
+static void pa_server_info_cb(pa_context *c, const pa_server_info *i, void *userdata) {
+    (void)userdata;
+    if (i && i->default_sink_name) {
+        strncpy(pa_handle.default_sink, i->default_sink_name,
+                sizeof(pa_handle.default_sink) - 1);
+        pa_handle.default_sink[sizeof(pa_handle.default_sink) - 1] = '\0';
+    }
+    pa_request_sink(c);
+}
+
+static void pa_request_server(pa_context *c) {
+    pa_operation *op = pa_context_get_server_info(c, pa_server_info_cb, NULL);
+    if (op) pa_operation_unref(op);
+}
+
+/* server events may move the default sink; sink events may change its volume */
+static void pa_subscribe_cb(pa_context *c, pa_subscription_event_type_t t, uint32_t idx, void *userdata) {
+    (void)idx;
+    (void)userdata;
+    unsigned facility = t & PA_SUBSCRIPTION_EVENT_FACILITY_MASK;
+    if (facility == PA_SUBSCRIPTION_EVENT_SERVER) pa_request_server(c);
+    else if (facility == PA_SUBSCRIPTION_EVENT_SINK) pa_request_sink(c);
+}
+
+static void pa_state_cb(pa_context *c, void *userdata) {
+    (void)userdata;
+    switch (pa_context_get_state(c)) {
+    case PA_CONTEXT_READY: {
+        pa_context_set_subscribe_callback(c, pa_subscribe_cb, NULL);
+        pa_operation *op = pa_context_subscribe(
+            c, (pa_subscription_mask_t)(PA_SUBSCRIPTION_MASK_SINK | PA_SUBSCRIPTION_MASK_SERVER),
+            NULL, NULL);
+        if (op) pa_operation_unref(op);
+        pa_request_server(c);
+        break;
+    }
+    case PA_CONTEXT_FAILED:
+    case PA_CONTEXT_TERMINATED:
+        pa_handle.failed = 1;
+        stat_inc(&self_stats.pa_failures);
+        pa_notify();
+        break;
+    default:
+        break;
+    }
+}
+
+static void fini_pulseaudio(void) {
+    if (!pa_handle.initialized) return;
+    pa_threaded_mainloop_lock(pa_handle.ml);
+    pa_context_disconnect(pa_handle.ctx);
+    pa_threaded_mainloop_unlock(pa_handle.ml);
+
+    pa_threaded_mainloop_stop(pa_handle.ml);
+    pa_context_unref(pa_handle.ctx);
+    pa_threaded_mainloop_free(pa_handle.ml);
+
+    pa_handle.ctx = NULL;
+    pa_handle.ml = NULL;
+    pa_handle.initialized = 0;
+    pa_handle.failed = 0;
+    pa_handle.default_sink[0] = '\0';
+    pub_write(&pa_handle.vol, 0, "0%");
+}
+
+/* start connecting; readiness, volume and failures all arrive through pa_state_cb */
+static int init_pulseaudio(void) {
+    if (pa_handle.initialized) return 0;
+
+    pa_handle.ml = pa_threaded_mainloop_new();
+    if (!pa_handle.ml) return -1;
+
+    pa_mainloop_api *api = pa_threaded_mainloop_get_api(pa_handle.ml);
+    pa_handle.ctx = pa_context_new(api, "intellibar");
+    if (!pa_handle.ctx) {
+        pa_threaded_mainloop_free(pa_handle.ml);
+        pa_handle.ml = NULL;
+        return -1;
+    }
+
+    pa_context_set_state_callback(pa_handle.ctx, pa_state_cb, NULL);
+
+    if (pa_context_connect(pa_handle.ctx, NULL, PA_CONTEXT_NOFLAGS, NULL) < 0 ||
+        pa_threaded_mainloop_start(pa_handle.ml) != 0) {
+        pa_context_unref(pa_handle.ctx);
+        pa_threaded_mainloop_free(pa_handle.ml);
+        pa_handle.ctx = NULL;
+        pa_handle.ml = NULL;
+        return -1;
+    }
+
+    pa_handle.initialized = 1;
+    stat_inc(&self_stats.pa_connects);
+    return 0;
+}
+
+static void pa_notify_cb(struct watch *w, uint32_t events) {
+    (void)events;
+    uint64_t cnt;
+    ssize_t n = read(w->fd, &cnt, sizeof(cnt));
+    count_syscalls(1);
+    (void)n;
+
+    if (pa_handle.failed) {
+        fini_pulseaudio();
+        timer_arm(pa_handle.retry.fd, PA_RETRY_SEC, 0);
+    }
+    module_refresh(MOD_AUDIO);
+}
+
+static void pa_retry_cb(struct watch *w, uint32_t events) {
+    (void)events;
+    timer_drain(w->fd);
+    if (init_pulseaudio() != 0) {
+        stat_inc(&self_stats.pa_failures);
+        timer_arm(w->fd, PA_RETRY_SEC, 0);
+    }
+}
+
+static void audio_start(void) {
+    pa_handle.notify.on_ready = pa_notify_cb;
+    pa_handle.retry.on_ready = pa_retry_cb;
+    pa_handle.notify.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    pa_handle.retry.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (pa_handle.notify.fd < 0 || pa_handle.retry.fd < 0 ||
+        watch_add(&pa_handle.notify, EPOLLIN) < 0 ||
+        watch_add(&pa_handle.retry, EPOLLIN) < 0) {
+        fprintf(stderr, "intellibar: cannot watch pulseaudio\n");
+        return;
+    }
+    atexit(fini_pulseaudio);
+    if (init_pulseaudio() != 0) {
+        stat_inc(&self_stats.pa_failures);
+        timer_arm(pa_handle.retry.fd, PA_RETRY_SEC, 0);
+    }
+}
+
+/* get_audio: render the last volume PulseAudio pushed to us */
+static int get_audio(char *out, size_t outlen) {
+    char vol[16];
+    pub_read(&pa_handle.vol, NULL, vol, sizeof(vol));
+    snprintf(out, outlen, "%4s", vol);
+    return 0;
+}
+
+/* ---------- Keyboard layout via sway IPC ---------- */
+
+#define I3_IPC_HEADER_SIZE 14
+#define I3_IPC_MESSAGE_TYPE_SUBSCRIBE 2
+#define I3_IPC_MESSAGE_TYPE_GET_INPUTS 100
+#define I3_IPC_EVENT 0x80000000u
+#define I3_IPC_EVENT_INPUT 0x80000015u
+#define SWAY_RETRY_SEC 5
+
+/* streaming JSON scanner: fed a reply chunk by chunk, it reports the string
+   values of a few wanted keys with their nesting depth and keeps nothing
+   else, so a reply of any size costs a fixed 100 bytes of state. The
+   callback sets done to skip the rest of the message */
+#define JSCAN_MAX_DEPTH 32
+
+struct jscan {
+    const char *const *keys;
+    int nkeys;
+    void (*cb)(struct jscan *js, int key, const char *val);
+    int done;
+    int depth;
+    uint32_t objects;           /* bit d: nesting level d+1 is an object, not an array */
+    int expect_key;             /* the next string is an object key */
+    int in_str, esc, is_key;
+    int key;                    /* wanted key whose value comes next, else -1 */
+    size_t len;
+    char buf[64];               /* the key or wanted value being read, truncated */
+};
+
+static void jscan_reset(struct jscan *js) {
+    js->done = js->depth = 0;
+    js->objects = 0;
+    js->expect_key = js->in_str = js->esc = js->is_key = 0;
+    js->key = -1;
+    js->len = 0;
+}
+
+static int jscan_in_object(const struct jscan *js) {
+    return js->depth > 0 && js->depth <= JSCAN_MAX_DEPTH && ((js->objects >> (js->depth - 1)) & 1);
+}
+
+static void jscan_take(struct jscan *js, const char *p, size_t n) {
+    if (!js->is_key && js->key < 0) return;         /* a string nobody asked for */
+    if (n > sizeof(js->buf) - 1 - js->len) n = sizeof(js->buf) - 1 - js->len;
+    memcpy(js->buf + js->len, p, n);
+    js->len += n;
+}
+
+static void jscan_string_end(struct jscan *js) {
+    js->buf[js->len] = '\0';
+    if (js->is_key) {
+        js->key = -1;
+        for (int k = 0; k < js->nkeys; ++k)
+            if (strcmp(js->buf, js->keys[k]) == 0) js->key = k;
+    } else if (js->key >= 0) {
+        js->cb(js, js->key, js->buf);
+        js->key = -1;
+    }
+}
+
+/* string bodies are skipped with memchr; outside strings only structural
+   characters matter and everything else (whitespace, numbers, literals) is
+   stepped over */
+static void jscan_feed(struct jscan *js, const char *p, size_t n) {
+    const char *end = p + n;
+    while (p < end && !js->done) {
+        if (js->esc) {                  /* escapes are kept as the bare character */
+            jscan_take(js, p++, 1);
+            js->esc = 0;
+            continue;
+        }
+        if (js->in_str) {
+            const char *q = (const char *)memchr(p, '"', (size_t)(end - p));
+            const char *stop = q ? q : end;
+            const char *bs = (const char *)memchr(p, '\\', (size_t)(stop - p));
+            if (bs) stop = bs;
+            jscan_take(js, p, (size_t)(stop - p));
+            p = stop;
+            if (p == end) break;
+            p++;
+            if (bs) {
+                js->esc = 1;
+            } else {
+                js->in_str = 0;
+                jscan_string_end(js);
+            }
+            continue;
+        }
+        switch (*p++) {
+        case '"':
+            js->in_str = 1;
+            js->is_key = js->expect_key;
+            js->len = 0;
+            break;
+        case '{':
+        case '[':
+            if (js->depth < JSCAN_MAX_DEPTH) {
+                uint32_t bit = 1u << js->depth;
+                js->objects = p[-1] == '{' ? js->objects | bit : js->objects & ~bit;
+            }
+            js->depth++;
+            js->expect_key = p[-1] == '{';
+            js->key = -1;
+            break;
+        case '}':
+        case ']':
+            if (js->depth > 0) js->depth--;
+            js->expect_key = 0;
+            js->key = -1;
+            break;
+        case ':':
+            js->expect_key = 0;
+            break;
+        case ',':
+            js->expect_key = jscan_in_object(js);
+            js->key = -1;
+            break;
+        }
+    }
+}
+
+/* one long-lived connection: GET_INPUTS once for the initial layout, then
+   layout changes arrive as input events; window, workspace and binding
+   events only feed the governor's idle detection. Payloads are scanned as
+   they are read and never stored */
+#define SWAY_CHUNK 4096
+
+enum { KB_KEY_CHANGE, KB_KEY_LAYOUT };
+static const char *const kb_keys[] = { "change", "xkb_active_layout_name" };
+
+static struct {
+    struct watch conn;
+    struct watch retry;
+    unsigned char hdr[I3_IPC_HEADER_SIZE];
+    size_t hdr_got;
+    uint32_t size, type;
+    size_t got;
+    char layout[64];
+
+    /* the message being read */
+    struct jscan scan;
+    int relevant;               /* input event: 1 layout change, 0 other, -1 not seen yet */
+    char found[64];             /* the first non-empty layout in it */
+} sway = { { -1, NULL }, { -1, NULL }, {0}, 0, 0, 0, 0, {0}, {}, 0, {0} };
+
+static void ipc_pack_header(unsigned char *hdr, uint32_t size, uint32_t type) {
+    memcpy(hdr, "i3-ipc", 6);
+    for (int i = 0; i < 4; ++i) {
+        hdr[6 + i] = (unsigned char)((size >> (8 * i)) & 0xff);
+        hdr[10 + i] = (unsigned char)((type >> (8 * i)) & 0xff);
+    }
+}
+
+static uint32_t ipc_u32(const unsigned char *p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+           ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static int sway_send(uint32_t type, const char *payload) {
+    unsigned char msg[I3_IPC_HEADER_SIZE + 64];
+    size_t len = strlen(payload);
+    if (len > sizeof(msg) - I3_IPC_HEADER_SIZE) return -1;
+    ipc_pack_header(msg, (uint32_t)len, type);
+    memcpy(msg + I3_IPC_HEADER_SIZE, payload, len);
+
+    size_t off = 0, total = I3_IPC_HEADER_SIZE + len;
+    while (off < total) {
+        ssize_t w = write(sway.conn.fd, msg + off, total - off);
+        count_syscalls(1);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        off += (size_t)w;
+    }
+    return 0;
+}
+
+/* copy the string value of the quoted "key" at or after p into out; "" for
+   null/missing. Returns where to continue scanning, NULL when not found */
+static const char *json_str_field(const char *p, const char *key, char *out, size_t outlen) {
+    out[0] = '\0';
+    size_t klen = strlen(key);
+    while ((p = strstr(p, key)) != NULL) {
+        p += klen;
+        const char *val = p;
+        while (*val == ' ' || *val == '\t' || *val == '\n') val++;
+        if (*val != ':') continue;
+        val++;
+        while (*val == ' ' || *val == '\t' || *val == '\n') val++;
+        if (*val != '"') return val;
+        val++;
+        const char *end = strchr(val, '"');
+        if (!end) return NULL;
+        size_t len = (size_t)(end - val);
+        if (len >= outlen) len = outlen - 1;
+        memcpy(out, val, len);
+        out[len] = '\0';
+        return end + 1;
+    }
+    return NULL;
+}
+
+/* GET_INPUTS is an array of input objects and an input event is
+   {"change":..., "input":{...}}: either way the layout sits at depth 2 */
+static void kb_scan_cb(struct jscan *js, int key, const char *val) {
+    if (key == KB_KEY_CHANGE && js->depth == 1 && sway.type != I3_IPC_EVENT_INPUT) {
+        /* workspace, window, binding and mode events only tell that someone
+           is there. Title changes count too: typing in one window often
+           produces nothing else */
+        gov_activity();
+        js->done = 1;
+    } else if (key == KB_KEY_CHANGE && js->depth == 1) {
+        gov_activity();
+        sway.relevant = strcmp(val, "xkb_layout") == 0 || strcmp(val, "xkb_keymap") == 0;
+        if (!sway.relevant) js->done = 1;
+    } else if (key == KB_KEY_LAYOUT && js->depth == 2 && val[0] && !sway.found[0]) {
+        snprintf(sway.found, sizeof(sway.found), "%s", val);
+        if (sway.type == I3_IPC_MESSAGE_TYPE_GET_INPUTS || sway.relevant == 1) js->done = 1;
+    }
+}
+
+static void kb_scan_begin(void) {
+    sway.scan.keys = kb_keys;
+    sway.scan.nkeys = (int)(sizeof(kb_keys) / sizeof(kb_keys[0]));
+    sway.scan.cb = kb_scan_cb;
+    jscan_reset(&sway.scan);
+    sway.relevant = -1;
+    sway.found[0] = '\0';
+}
+
+/* adopt the layout once the whole message is in; 1 when it changed */
+static int kb_scan_end(void) {
+    if (sway.type & I3_IPC_EVENT) stat_inc(&self_stats.sway_events);
+    if (!sway.found[0] || (sway.type == I3_IPC_EVENT_INPUT && sway.relevant != 1)) return 0;
+    memcpy(sway.layout, sway.found, sizeof(sway.layout));
+    return 1;
+}
+
+/* frame i3-ipc messages out of the byte stream and feed payloads to the
+   scanner, stopping at the end of the first message that completes; once
+   the scanner has what it wants the rest of a payload is stepped over.
+   Returns the bytes used, with *complete set when a message ended there,
+   or -1 on a corrupt header */
+static ssize_t sway_consume(const char *p, size_t n, int *complete) {
+    size_t used = 0;
+    *complete = 0;
+    while (used < n) {
+        if (sway.hdr_got < I3_IPC_HEADER_SIZE) {
+            size_t k = I3_IPC_HEADER_SIZE - sway.hdr_got;
+            if (k > n - used) k = n - used;
+            memcpy(sway.hdr + sway.hdr_got, p + used, k);
+            sway.hdr_got += k;
+            used += k;
+            if (sway.hdr_got < I3_IPC_HEADER_SIZE) break;
+            if (memcmp(sway.hdr, "i3-ipc", 6) != 0) return -1;
+            sway.size = ipc_u32(sway.hdr + 6);
+            sway.type = ipc_u32(sway.hdr + 10);
+            sway.got = 0;
+            kb_scan_begin();
+        } else {
+            size_t k = sway.size - sway.got;
+            if (k > n - used) k = n - used;
+            if (!sway.scan.done) jscan_feed(&sway.scan, p + used, k);
+            sway.got += k;
+            used += k;
+        }
+        if (sway.got == sway.size) {
+            sway.hdr_got = 0;
+            *complete = 1;
+            break;
+        }
+    }
+    return (ssize_t)used;
+}
+
+/* what a lost connection does to the stream state */
+static void sway_reset(void) {
+    if (tape.fd >= 0) tape_emit(TAPE_SWAY, MOD_KB, 0, NULL, 0, NULL, 0);
+    sway.hdr_got = 0;
+    sway.layout[0] = '\0';
+}
+
+static void sway_disconnect(void) {
+    stat_inc(&self_stats.sway_failures);
+    if (sway.conn.fd >= 0) {
+        close(sway.conn.fd);
+        count_syscalls(1);
+    }
+    sway.conn.fd = -1;
+    sway_reset();
+    module_refresh(MOD_KB);
+    timer_arm(sway.retry.fd, SWAY_RETRY_SEC, 0);
+}
+
+/* read the non-blocking stream in chunks of any size; with --record each
+   message's bytes are logged as they are consumed, so that --replay runs
+   them through the same framing and scanner */
+static void sway_read_cb(struct watch *w, uint32_t events) {
+    (void)events;
+    char chunk[SWAY_CHUNK];
+    for (;;) {
+        ssize_t n = read(w->fd, chunk, sizeof(chunk));
+        count_syscalls(1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN) return;
+            sway_disconnect();
+            return;
+        }
+        if (n == 0) {
+            sway_disconnect();
+            return;
+        }
+        for (ssize_t off = 0; off < n;) {
+            int complete;
+            ssize_t used = sway_consume(chunk + off, (size_t)(n - off), &complete);
+            if (used < 0) {
+                sway_disconnect();
+                return;
+            }
+            if (tape.fd >= 0) tape_emit(TAPE_SWAY, MOD_KB, 0, chunk + off, (size_t)used, NULL, 0);
+            off += used;
+            if (complete && kb_scan_end()) module_refresh(MOD_KB);
+        }
+    }
+}
+
+static int sway_connect(void) {
+    const char *sock = getenv("SWAYSOCK");
+    if (!sock || !*sock) return -1;
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    count_syscalls(1);
+    if (fd < 0) return -1;
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", sock);
+
+    count_syscalls(1);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    sway.conn.fd = fd;
+    sway.hdr_got = 0;
+    if (sway_send(I3_IPC_MESSAGE_TYPE_SUBSCRIBE, "[\"input\",\"window\",\"workspace\",\"binding\",\"mode\"]") < 0 ||
+        sway_send(I3_IPC_MESSAGE_TYPE_GET_INPUTS, "") < 0 ||
+        watch_add(&sway.conn, EPOLLIN) < 0) {
+        close(fd);
+        sway.conn.fd = -1;
+        return -1;
+    }
+    stat_inc(&self_stats.sway_connects);
+    gov_activity();
+    return 0;
+}
+
+static void sway_retry_cb(struct watch *w, uint32_t events) {
+    (void)events;
+    timer_drain(w->fd);
+    if (sway.conn.fd < 0 && sway_connect() < 0) {
+        stat_inc(&self_stats.sway_failures);
+        timer_arm(w->fd, SWAY_RETRY_SEC, 0);
+    }
+}
+
+static void sway_start(void) {
+    sway.conn.on_ready = sway_read_cb;
+    sway.retry.on_ready = sway_retry_cb;
+    sway.retry.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (sway.retry.fd < 0 || watch_add(&sway.retry, EPOLLIN) < 0) return;
+    if (sway_connect() < 0) {
+        stat_inc(&self_stats.sway_failures);
+        timer_arm(sway.retry.fd, SWAY_RETRY_SEC, 0);
+    }
+}
+
+static int get_kb(char *out, size_t outlen) {
+    const char *best = sway.layout;
+    if (best[0] == '\0') {
+        snprintf(out, outlen, "??");
+        return 0;
+    }
+
+    if (strstr(best, "UK") || strstr(best, "United Kingdom") || strstr(best, "British")) {
+        snprintf(out, outlen, "UK");
+        return 0;
+    }
+    if (strstr(best, "Romanian")) {
+        snprintf(out, outlen, "RO");
+        return 0;
+    }
+
+    char s[3] = {'?', '?', '\0'};
+    if (best[0]) s[0] = (best[0] >= 'a' && best[0] <= 'z') ? (char)(best[0] - 32) : best[0];
+    if (best[1]) s[1] = (best[1] >= 'a' && best[1] <= 'z') ? (char)(best[1] - 32) : best[1];
+
+    snprintf(out, outlen, "%s", s);
+    return 0;
+}
+
+/* ---------- modules ---------- */
+
+#define STALE_MARK "~"
+#define COLLECT_DEADLINE_MS 1000
+#define LAT_BUCKETS 16
+
+/* updated from whichever thread ran the collector */
+struct mod_stats {
+    unsigned long runs, failures, late;
+    unsigned long lat[LAT_BUCKETS];     /* bucket k: < 2^k us, last bucket open-ended */
+    long long max_ns;
+};
+
+struct module {
+    const char *name;
+    int (*collect)(char *out, size_t outlen);   /* LEVEL_* on success, -1 when the source failed */
+    int interval;               /* seconds; 0 = event-driven, refreshed via module_refresh */
+    int pooled;                 /* may block (statvfs, plugins): sampled on a worker, not the reactor */
+    int width;                  /* plugins: columns the text is padded or cut to, 0 = as is */
+    struct watch timer;
+    int shown;                  /* in the layout; hidden periodic modules are not sampled */
+
+    /* reactor side */
+    int busy;                   /* queued or running on a worker */
+    int stale;                  /* missed its deadline or failed; showing the last good value */
+    long long started_ms;
+    char good[FIELD_LEN];       /* last successful output */
+    char text[FIELD_LEN + sizeof(STALE_MARK)];
+    int level;                  /* LEVEL_* of the last good sample */
+    unsigned text_gen;          /* loop.gen when text or level last changed */
+    int stable;                 /* runs in a row that left text and level as they were */
+
+    /* worker -> reactor handoff; busy keeps a module to one writer at a time */
+    struct intellibar_slot result;
+    unsigned seen_gen;
+
+    struct mod_stats st;
+    struct tape_frame tape;     /* --record: inputs of the run in progress */
+};
+
+/* a built-in module: everything after the interval starts zeroed */
+#define MODULE(name, collect, interval, pooled) \
+    { name, collect, interval, pooled, 0, {}, 0, 0, 0, 0, "", "", 0, 0, 0, {}, 0, {}, {} }
+
+static struct module modules[MOD_COUNT] = {
+    MODULE("mem",   get_mem,       STATS_INTERVAL, 0),
+    MODULE("cpu",   get_cpu_usage, STATS_INTERVAL, 0),
+    MODULE("temp",  get_temp,      STATS_INTERVAL, 0),
+    MODULE("disk",  get_disk,      30,             1),
+    MODULE("net",   get_net_speed, STATS_INTERVAL, 0),
+    MODULE("audio", get_audio,     0,              0),
+    MODULE("kb",    get_kb,        0,              0),
+    MODULE("batt",  get_battery,   30,             0),
+    MODULE("top",   get_top,       STATS_INTERVAL, 0),
+    MODULE("wifi",  get_wifi,      STATS_INTERVAL, 0),
+};
+
+static void module_set_text(struct module *m, const char *text) {
+    if (strcmp(text, m->text) == 0) return;
+    str_copy(m->text, sizeof(m->text), text);
+    m->text_gen = ++loop.gen;
+}
+
+/* pad or cut to width UTF-8 characters */
+static void text_fit(char *out, size_t outlen, const char *in, int width) {
+    size_t off = 0;
+    for (; *in && off + 1 < outlen; ++in) {
+        if ((*in & 0xC0) != 0x80 && width-- == 0) break;
+        out[off++] = *in;
+    }
+    while (width-- > 0 && off + 1 < outlen) out[off++] = ' ';
+    out[off] = '\0';
+}
+
+/* a failed or late collector keeps showing its last good value, marked stale */
+static void module_publish(struct module *m, int rc, const char *buf) {
+    char fit[FIELD_LEN];
+    if (m->width && rc >= 0) {
+        text_fit(fit, sizeof(fit), buf, m->width);
+        buf = fit;
+    }
+    if (rc >= 0) {
+        m->stale = 0;
+        if (m->level != rc) {
+            m->level = rc;
+            m->text_gen = ++loop.gen;
+        }
+        str_copy(m->good, sizeof(m->good), buf);
+        module_set_text(m, buf);
+        return;
+    }
+    m->stale = 1;
+    if (!m->good[0]) {
+        module_set_text(m, buf[0] ? buf : "N/A");
+        return;
+    }
+    char text[sizeof(m->text)];
+    snprintf(text, sizeof(text), "%s%s", STALE_MARK, m->good);
+    module_set_text(m, text);
+}
+
+static void mod_stats_record(struct mod_stats *st, int rc, long long ns) {
+    stat_inc(&st->runs);
+    if (rc < 0) stat_inc(&st->failures);
+    int b = 0;
+    for (long long us = ns / 1000; us > 0 && b < LAT_BUCKETS - 1; us >>= 1) b++;
+    stat_inc(&st->lat[b]);
+    long long prev = __atomic_load_n(&st->max_ns, __ATOMIC_RELAXED);
+    while (ns > prev &&
+           !__atomic_compare_exchange_n(&st->max_ns, &prev, ns, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+/* audio is fed by PulseAudio callbacks and plugins by whatever they read:
+   for them only the text is recorded, and replayed as is. kb reads no input
+   of its own; the sway bytes behind its layout are TAPE_SWAY records */
+static int tape_text_only(int id) {
+    return id == MOD_AUDIO || id >= MOD_PLUGIN;
+}
+
+/* run the collector on the calling thread, timing it for the stats dump.
+   With --record its inputs and text go to the tape; a run that outgrew
+   TAPE_FRAME_MAX is left out */
+static int module_collect(struct module *m, char *buf, size_t buflen) {
+    int id = (int)(m - modules);
+    int inputs = tape.fd >= 0 && !tape_text_only(id);
+    if (inputs) {
+        if (!m->tape.buf) m->tape.buf = (char *)malloc(TAPE_FRAME_MAX);
+        m->tape.len = 0;
+        m->tape.bad = !m->tape.buf;
+        tape_cur = &m->tape;
+    }
+    long long t0 = now_ns();
+    int rc = m->collect(buf, buflen);
+    mod_stats_record(&m->st, rc, now_ns() - t0);
+    tape_cur = NULL;
+    if (tape.fd >= 0 && !(inputs && m->tape.bad))
+        tape_emit(TAPE_RUN, id, rc, buf, strlen(buf) + 1, m->tape.buf, inputs ? m->tape.len : 0);
+    return rc;
+}
+
+static void module_run(struct module *m) {
+    char buf[sizeof(m->good)];
+    int rc = module_collect(m, buf, sizeof(buf));
+    module_publish(m, rc, buf);
+}
+
+/* ---------- sampling governor ---------- */
+
+/* a periodic module's timer runs at its configured interval times a factor:
+   GOV_BATTERY while the battery field reads discharging, GOV_IDLE once sway
+   has been quiet for GOV_IDLE_SEC (no focus, title, workspace, binding, mode
+   or input events: idle, or locked), and a doubling per GOV_STABLE_RUNS
+   samples its text stayed the same. The product is capped at GOV_MAX_FACTOR,
+   so a 2 s field is never sampled less than every 8 s. Any sway activity and
+   any change in a field's text restore the rate at once */
+#define GOV_BATTERY 2
+#define GOV_IDLE 4
+#define GOV_IDLE_SEC 120
+#define GOV_STABLE_RUNS 5
+#define GOV_STABLE_MAX 4
+#define GOV_MAX_FACTOR 4
+#define GOV_MAX_INTERVAL 30     /* no slowed interval goes past this, or past the configured one if longer */
+
+static struct {
+    int enabled;
+    int factor;                 /* battery and idle multipliers in effect */
+    int idle;
+    int armed;                  /* idle_timer pending */
+    struct watch idle_timer;
+    long long active_ms;        /* last sway activity */
+
+    /* wakeups (reactor and workers) per hour at the configured rate and slowed down */
+    long long since_ms;
+    unsigned long since_wakeups;
+    double secs[2];
+    unsigned long wakeups[2];
+} gov = { GOVERNOR, 1, 0, 0, { -1, NULL }, 0, 0, 0, {0, 0}, {0, 0} };
+
+static int module_arm(struct module *m);
+
+static int gov_boost(const struct module *m) {
+    int b = 1;
+    for (int runs = m->stable; runs >= GOV_STABLE_RUNS && b < GOV_STABLE_MAX; runs -= GOV_STABLE_RUNS) b *= 2;
+    return b;
+}
+
+/* the interval a periodic module's timer runs at */
+static int module_period(const struct module *m) {
+    if (!gov.enabled) return m->interval;
+    int f = gov.factor * gov_boost(m);
+    int p = m->interval * (f < GOV_MAX_FACTOR ? f : GOV_MAX_FACTOR);
+    int cap = m->interval > GOV_MAX_INTERVAL ? m->interval : GOV_MAX_INTERVAL;
+    return p < cap ? p : cap;
+}
+
+/* close the accounting period of the current factor */
+static void gov_account(void) {
+    long long now = now_ms();
+    int k = gov.factor > 1;
+    if (gov.since_ms) {
+        gov.secs[k] += (double)(now - gov.since_ms) / 1000.0;
+        gov.wakeups[k] += wakeups_total() - gov.since_wakeups;
+    }
+    gov.since_ms = now;
+    gov.since_wakeups = wakeups_total();
+}
+
+/* recompute the factor; on a change every periodic timer moves to its new period */
+static void gov_update(int force) {
+    int on_battery = __atomic_load_n(&batt.on_battery, __ATOMIC_RELAXED) && modules[MOD_BATT].shown;
+    int f = gov.enabled ? (on_battery ? GOV_BATTERY : 1) * (gov.idle ? GOV_IDLE : 1) : 1;
+    if (f == gov.factor && !force) return;
+    gov_account();
+    gov.factor = f;
+    for (int i = 0; i < MOD_COUNT; ++i) module_arm(&modules[i]);
+}
+
+/* after each published sample: a field that keeps saying the same thing
+   slows down, one that changed goes back to its full rate */
+static void gov_sampled(struct module *m, int changed) {
+    if (!gov.enabled || !m->interval) return;
+    int before = gov_boost(m);
+    m->stable = changed ? 0 : m->stable + 1;
+    if (gov_boost(m) != before) module_arm(m);
+}
+
+static void gov_activity(void) {
+    gov.active_ms = now_ms();
+    if (!gov.armed && gov.idle_timer.fd >= 0) {
+        timer_arm(gov.idle_timer.fd, GOV_IDLE_SEC, 0);
+        gov.armed = 1;
+    }
+    if (!gov.idle) return;
+    gov.idle = 0;
+    gov_update(0);
+    for (int i = 0; i < MOD_COUNT; ++i)          /* back at the screen: no stale values */
+        if (modules[i].shown && modules[i].interval) module_refresh(i);
+}
+
+/* activity only records a timestamp; the timer checks it when it expires */
+static void gov_idle_cb(struct watch *w, uint32_t events) {
+    (void)events;
+    timer_drain(w->fd);
+    long long left = gov.active_ms + GOV_IDLE_SEC * 1000LL - now_ms();
+    if (left > 0) {
+        timer_arm(w->fd, (int)((left + 999) / 1000), 0);
+        return;
+    }
+    gov.armed = 0;
+    gov.idle = 1;
+    gov_update(0);
+}
+
+static void gov_start(void) {
+    gov.since_ms = now_ms();
+    gov.idle_timer.on_ready = gov_idle_cb;
+    gov.idle_timer.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (gov.idle_timer.fd >= 0 && watch_add(&gov.idle_timer, EPOLLIN) < 0) {
+        close(gov.idle_timer.fd);
+        gov.idle_timer.fd = -1;
+    }
+}
+
+/* ---------- workers ---------- */
+
+/* collectors that can block (a hung statvfs on a dead network mount, a
+   plugin's own reads) run off the reactor thread so that they cannot hold up
+   the others. The rest only read procfs, sysfs and netlink and are cheaper
+   sampled in place than handed over: a job costs a condvar and an eventfd
+   wakeup. The pool grows on demand, so a collector stuck forever only costs
+   its own thread */
+#define MAX_WORKERS MOD_COUNT
+
+static struct {
+    pthread_mutex_t mtx;
+    pthread_cond_t cond;
+    int queue[MOD_COUNT];
+    int head, len;
+    int idle, starting, threads;
+    struct watch done;          /* eventfd: some worker finished a job */
+    struct watch deadline;      /* timerfd: earliest outstanding deadline */
+} pool = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, {0}, 0, 0, 0, 0, 0,
+           { -1, NULL }, { -1, NULL } };
+
+static void *worker_main(void *) {
+    pthread_mutex_lock(&pool.mtx);
+    pool.starting--;
+    int woken = 1;                      /* starting counts as a wakeup */
+    for (;;) {
+        while (pool.len == 0) {
+            pool.idle++;
+            pthread_cond_wait(&pool.cond, &pool.mtx);
+            pool.idle--;
+            woken = 1;
+        }
+        if (woken) stat_inc(&io_stats.worker_wakeups);
+        woken = 0;
+        struct module *m = &modules[pool.queue[pool.head]];
+        pool.head = (pool.head + 1) % MOD_COUNT;
+        pool.len--;
+        pthread_mutex_unlock(&pool.mtx);
+
+        /* straight into the handoff slot */
+        int rc = module_collect(m, intellibar_back(&m->result), FIELD_LEN);
+        pub_commit(&m->result, rc);
+
+        uint64_t one = 1;
+        ssize_t n = write(pool.done.fd, &one, sizeof(one));
+        (void)n;
+        pthread_mutex_lock(&pool.mtx);
+    }
+    return NULL;
+}
+
+static void deadline_rearm(void) {
+    long long next = 0;
+    for (int i = 0; i < MOD_COUNT; ++i) {
+        const struct module *m = &modules[i];
+        if (!m->busy || m->stale) continue;
+        long long due = m->started_ms + COLLECT_DEADLINE_MS;
+        if (next == 0 || due < next) next = due;
+    }
+
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    if (next) {
+        long long delay = next - now_ms();
+        if (delay < 1) delay = 1;
+        its.it_value.tv_sec = delay / 1000;
+        its.it_value.tv_nsec = (delay % 1000) * 1000000;
+    }
+    timerfd_settime(pool.deadline.fd, 0, &its, NULL);
+}
+
+/* queue a collector unless its previous run is still outstanding */
+static void module_submit(struct module *m) {
+    if (m->busy) return;
+    m->busy = 1;
+    m->started_ms = now_ms();
+    stat_inc(&io_stats.jobs);
+
+    pthread_mutex_lock(&pool.mtx);
+    pool.queue[(pool.head + pool.len) % MOD_COUNT] = (int)(m - modules);
+    pool.len++;
+    if (pool.idle + pool.starting > 0 || pool.threads >= MAX_WORKERS) {
+        pthread_cond_signal(&pool.cond);
+    } else {
+        pthread_t th;
+        if (pthread_create(&th, NULL, worker_main, NULL) == 0) {
+            pthread_detach(th);
+            pool.threads++;
+            pool.starting++;
+        }
+    }
+    pthread_mutex_unlock(&pool.mtx);
+    deadline_rearm();
+}
+
+static void pool_done_cb(struct watch *w, uint32_t events) {
+    (void)events;
+    uint64_t cnt;
+    ssize_t n = read(w->fd, &cnt, sizeof(cnt));
+    count_syscalls(1);
+    (void)n;
+
+    for (int i = 0; i < MOD_COUNT; ++i) {
+        struct module *m = &modules[i];
+        if (__atomic_load_n(&m->result.gen, __ATOMIC_ACQUIRE) == m->seen_gen) continue;
+
+        char buf[sizeof(m->good)];
+        int rc;
+        m->seen_gen = pub_read(&m->result, &rc, buf, sizeof(buf));
+        m->busy = 0;
+        unsigned gen = m->text_gen;
+        module_publish(m, rc, buf);
+        gov_sampled(m, m->text_gen != gen);
+    }
+    deadline_rearm();
+}
+
+static void deadline_cb(struct watch *w, uint32_t events) {
+    (void)events;
+    timer_drain(w->fd);
+    long long now = now_ms();
+    for (int i = 0; i < MOD_COUNT; ++i) {
+        struct module *m = &modules[i];
+        if (m->busy && !m->stale && now - m->started_ms >= COLLECT_DEADLINE_MS) {
+            stat_inc(&m->st.late);
+            module_publish(m, -1, "");
+        }
+    }
+    deadline_rearm();
+}
+
+static int pool_start(void) {
+    pool.done.on_ready = pool_done_cb;
+    pool.deadline.on_ready = deadline_cb;
+    pool.done.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    pool.deadline.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (pool.done.fd < 0 || pool.deadline.fd < 0) return -1;
+    if (watch_add(&pool.done, EPOLLIN) < 0 || watch_add(&pool.deadline, EPOLLIN) < 0) return -1;
+    return 0;
+}
+
+/* a periodic sample: queued for a worker, or taken right here */
+static void module_sample(struct module *m) {
+    if (m->pooled) {
+        module_submit(m);
+        return;
+    }
+    unsigned gen = m->text_gen;
+    module_run(m);
+    gov_sampled(m, m->text_gen != gen);
+    if (m == &modules[MOD_BATT]) gov_update(0);     /* the adapter may have come or gone */
+}
+
+static void module_refresh(int id) {
+    struct module *m = &modules[id];
+    if (!m->collect) return;            /* a plugin fed only by its fds */
+    if (m->interval == 0) module_run(m);
+    else module_sample(m);
+}
+
+static void module_timer_cb(struct watch *w, uint32_t events) {
+    (void)events;
+    struct module *m = (struct module *)((char *)w - offsetof(struct module, timer));
+    if (timer_drain(w->fd) == 0) return;
+    module_sample(m);
+}
+
+/* all collector timers share one monotonic phase so that coinciding ticks
+   collapse into a single wakeup instead of one per module */
+static time_t timer_phase;
+
+/* (re)arm a periodic module on the shared phase at its governed period, or
+   disarm it when hidden */
+static int module_arm(struct module *m) {
+    if (m->interval == 0 || !m->timer.on_ready) return 0;
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    if (m->shown) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        int period = module_period(m);
+        its.it_value.tv_sec = timer_phase + ((now.tv_sec - timer_phase) / period + 1) * period;
+        its.it_interval.tv_sec = period;
+    }
+    return timerfd_settime(m->timer.fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+static int modules_start(void) {
+    if (pool_start() < 0) return -1;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    timer_phase = now.tv_sec;
+
+    for (int i = 0; i < MOD_COUNT; ++i) {
+        struct module *m = &modules[i];
+        if (m->interval) {
+            m->timer.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+            if (m->timer.fd < 0) return -1;
+            m->timer.on_ready = module_timer_cb;
+            if (watch_add(&m->timer, EPOLLIN) < 0) return -1;
+        }
+        if (!m->shown) continue;
+        module_refresh(i);
+        if (module_arm(m) < 0) return -1;
+    }
+    return 0;
+}
+
+/* ---------- plugins ---------- */
+
+/* --plugin FILE loads a collector built against intellibar-module.h into the
+   next free MOD_PLUGIN slot, before the config is read so that its name can
+   be used there. Its timer and worker runs are the built-in ones; its fds
+   are watched by the reactor like any other */
+static struct plugin {
+    const struct intellibar_module *def;
+    struct intellibar_host host;
+    int nfds;
+    struct watch fds[INTELLIBAR_MAX_FDS];
+} plugins[PLUGIN_MAX];
+
+static int plugin_count;
+
+/* from a plugin's own thread: the same commit and wakeup a worker does */
+static int plugin_publish(const struct intellibar_host *host, int level) {
+    pub_commit(host->slot, level);
+    uint64_t one = 1;
+    ssize_t n = write(pool.done.fd, &one, sizeof(one));
+    (void)n;
+    return 0;
+}
+
+/* a plugin with collect(): its slot is written by the worker runs only */
+static int plugin_publish_refused(const struct intellibar_host *host, int level) {
+    (void)host;
+    (void)level;
+    return -1;
+}
+
+/* already on the reactor, so the text is published directly */
+static void plugin_fd_cb(struct watch *w, uint32_t events) {
+    for (int i = 0; i < plugin_count; ++i) {
+        struct plugin *pl = &plugins[i];
+        if (w < pl->fds || w >= pl->fds + pl->nfds) continue;
+        char buf[FIELD_LEN] = "";
+        int rc = pl->def->ready(w->fd, events, buf, sizeof(buf));
+        if (rc != INTELLIBAR_KEEP) module_publish(&modules[MOD_PLUGIN + i], rc < 0 ? -1 : rc, buf);
+        return;
+    }
+}
+
+static int plugin_name_taken(const char *name) {
+    if (strcmp(name, "clock") == 0) return 1;
+    for (int i = 0; i < MOD_COUNT; ++i)
+        if (modules[i].name && strcmp(modules[i].name, name) == 0) return 1;
+    return 0;
+}
+
+static int plugin_load(const char *path) {
+    if (plugin_count == PLUGIN_MAX) {
+        fprintf(stderr, "intellibar: plugin %s: only %d plugins fit\n", path, PLUGIN_MAX);
+        return -1;
+    }
+    void *so = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    const struct intellibar_module *def =
+        so ? (const struct intellibar_module *)dlsym(so, "intellibar_module") : NULL;
+    if (!def) {
+        fprintf(stderr, "intellibar: plugin %s: %s\n", path, dlerror());
+        if (so) dlclose(so);
+        return -1;
+    }
+    const char *why = def->abi != INTELLIBAR_MODULE_ABI ? "ABI version" :
+                      !def->name || !def->name[0] ? "name" :
+                      plugin_name_taken(def->name) ? "name already in use" :
+                      def->interval < 0 || def->interval > 86400 || (def->interval && !def->collect) ? "interval" :
+                      def->width < 0 || def->width >= FIELD_LEN ? "width" : NULL;
+    if (why) {
+        fprintf(stderr, "intellibar: plugin %s: bad %s\n", path, why);
+        dlclose(so);
+        return -1;
+    }
+
+    struct plugin *pl = &plugins[plugin_count];
+    struct module *m = &modules[MOD_PLUGIN + plugin_count];
+    pl->def = def;
+    pl->host.abi = INTELLIBAR_MODULE_ABI;
+    pl->host.slot = def->collect ? NULL : &m->result;
+    pl->host.publish = def->collect ? plugin_publish_refused : plugin_publish;
+    /* from here on the library stays mapped even if loading fails: init may
+       have started a thread or kept host */
+    int fds[INTELLIBAR_MAX_FDS];
+    int n = def->init ? def->init(&pl->host, fds, INTELLIBAR_MAX_FDS) : 0;
+    if (n < 0 || n > INTELLIBAR_MAX_FDS) {
+        fprintf(stderr, "intellibar: plugin %s: init failed\n", path);
+        return -1;
+    }
+    for (int k = 0; k < n; ++k) {
+        pl->fds[k].fd = fds[k];
+        pl->fds[k].on_ready = plugin_fd_cb;
+        if (!def->ready || watch_add(&pl->fds[k], EPOLLIN) < 0) {
+            if (def->ready) perror("intellibar: plugin fd");
+            else fprintf(stderr, "intellibar: plugin %s: fds but no ready()\n", path);
+            for (int j = 0; j < n; ++j) close(fds[j]);      /* also drops the ones already watched */
+            return -1;
+        }
+    }
+    pl->nfds = n;
+
+    /* fields fed only by ready() or publish() have no text until the first
+       event; like the built-in fields they show N/A meanwhile, or the first
+       line would be held back */
+    char na[FIELD_LEN];
+    if (def->width) text_fit(na, sizeof(na), "N/A", def->width);
+    else str_copy(na, sizeof(na), "N/A");
+    module_set_text(m, na);
+    m->name = def->name;
+    m->collect = def->collect;
+    m->interval = def->interval;
+    m->pooled = 1;
+    m->width = def->width;
+    plugin_count++;
+    return 0;
+}
+
+/* ---------- kernel uevents ---------- */
+
+/* NETLINK_KOBJECT_UEVENT messages are "action@devpath\0KEY=value\0..." */
+static const char *uevent_get(const char *msg, size_t len, const char *key) {
+    size_t klen = strlen(key);
+    const char *p = msg;
+    const char *end = msg + len;
+    while (p < end) {
+        size_t n = strnlen(p, (size_t)(end - p));
+        if (n > klen && p[klen] == '=' && memcmp(p, key, klen) == 0) return p + klen + 1;
+        p += n + 1;
+    }
+    return "";
+}
+
+static void uevent_cb(struct watch *w, uint32_t events) {
+    (void)events;
+    char msg[8192];
+    for (;;) {
+        struct sockaddr_nl sa;
+        socklen_t salen = sizeof(sa);
+        ssize_t n = recvfrom(w->fd, msg, sizeof(msg) - 1, MSG_DONTWAIT,
+                             (struct sockaddr *)&sa, &salen);
+        count_syscalls(1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return;
+        }
+        if (sa.nl_pid != 0) continue;       /* only trust the kernel */
+        msg[n] = '\0';
+
+        const char *subsystem = uevent_get(msg, (size_t)n, "SUBSYSTEM");
+        if (strcmp(subsystem, "hwmon") == 0) {
+            flag_raise(&temp_cache.rescan);
+            module_refresh(MOD_TEMP);
+        } else if (strcmp(subsystem, "power_supply") == 0) {
+            /* plug, unplug and status changes show at once; add/remove re-probe */
+            if (strcmp(uevent_get(msg, (size_t)n, "ACTION"), "change") != 0) flag_raise(&batt.rescan);
+            if (modules[MOD_BATT].shown) module_refresh(MOD_BATT);
+        }
+    }
+}
+
+static struct watch uevent_watch = { -1, uevent_cb };
+
+/* hotplug is best effort: without it sensors are still re-probed on read failure */
+static void uevent_start(void) {
+    int fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                    NETLINK_KOBJECT_UEVENT);
+    if (fd < 0) return;
+
+    struct sockaddr_nl sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.nl_family = AF_NETLINK;
+    sa.nl_groups = 1;                       /* kernel broadcast group */
+    if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+        close(fd);
+        return;
+    }
+    uevent_watch.fd = fd;
+    if (watch_add(&uevent_watch, EPOLLIN) < 0) {
+        close(fd);
+        uevent_watch.fd = -1;
+    }
+}
+
+/* ---------- link/route events ---------- */
+
+/* any link or default-route change may move traffic to another interface */
+static void rtnl_events_cb(struct watch *w, uint32_t events) {
+    (void)events;
+    static char buf[8192] __attribute__((aligned(NLMSG_ALIGNTO)));
+    for (;;) {
+        ssize_t n = recv(w->fd, buf, sizeof(buf), MSG_DONTWAIT);
+        count_syscalls(1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == ENOBUFS) flag_raise(&net.resolve);   /* overran: assume we missed something */
+            return;
+        }
+        int ifindex = __atomic_load_n(&net.ifindex, __ATOMIC_RELAXED);
+        for (struct nlmsghdr *nh = (struct nlmsghdr *)buf; NLMSG_OK(nh, (size_t)n);
+             nh = NLMSG_NEXT(nh, n)) {
+            if (nh->nlmsg_type == RTM_NEWROUTE || nh->nlmsg_type == RTM_DELROUTE) {
+                const struct rtmsg *rt = (const struct rtmsg *)NLMSG_DATA(nh);
+                if (rt->rtm_dst_len == 0) flag_raise(&net.resolve);
+            } else if (nh->nlmsg_type == RTM_DELLINK) {
+                const struct ifinfomsg *ifi = (const struct ifinfomsg *)NLMSG_DATA(nh);
+                if (ifi->ifi_index == ifindex) flag_raise(&net.resolve);
+                flag_raise(&wifi.resolve);
+            } else if (nh->nlmsg_type == RTM_NEWLINK) {
+                if (cfg.net_iface[0] && ifindex == 0) flag_raise(&net.resolve);    /* pinned interface may have appeared */
+                if (__atomic_load_n(&wifi.ifindex, __ATOMIC_RELAXED) == 0) flag_raise(&wifi.resolve);   /* or a wireless one */
+            }
+        }
+    }
+}
+
+static struct watch rtnl_events_watch = { -1, rtnl_events_cb };
+
+static void rtnl_events_start(void) {
+    int fd = socket(AF_NETLINK, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_ROUTE);
+    if (fd < 0) return;
+
+    struct sockaddr_nl sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.nl_family = AF_NETLINK;
+    sa.nl_groups = RTMGRP_LINK | RTMGRP_IPV4_ROUTE | RTMGRP_IPV6_ROUTE;
+    if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0 ||
+        (rtnl_events_watch.fd = fd, watch_add(&rtnl_events_watch, EPOLLIN)) < 0) {
+        close(fd);
+        rtnl_events_watch.fd = -1;
+    }
+}
+
+/* ---------- Wi-Fi events ---------- */
+
+/* nl80211 announces association changes on its "mlme" group and interfaces
+   coming and going on "config": either sends the wifi field to re-pick its
+   interface and SSID and sample at once, instead of at its next tick */
+static struct {
+    struct nl_sock nl;
+    int family;
+} wifi_ev = { { -1, NETLINK_GENERIC, 0, &self_stats.genl_errors, "" }, 0 };
+
+static void wifi_events_cb(struct watch *w, uint32_t events) {
+    (void)events;
+    int hit = 0;
+    for (;;) {
+        ssize_t n = recv(w->fd, wifi_ev.nl.buf, sizeof(wifi_ev.nl.buf), MSG_DONTWAIT);
+        count_syscalls(1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == ENOBUFS) hit = 1;      /* overran: assume we missed something */
+            break;
+        }
+        for (struct nlmsghdr *nh = (struct nlmsghdr *)wifi_ev.nl.buf; NLMSG_OK(nh, (size_t)n);
+             nh = NLMSG_NEXT(nh, n)) {
+            if (nh->nlmsg_type != wifi_ev.family) continue;
+            switch (((const struct genlmsghdr *)NLMSG_DATA(nh))->cmd) {
+            case NL80211_CMD_CONNECT:
+            case NL80211_CMD_DISCONNECT:
+            case NL80211_CMD_ROAM:
+            case NL80211_CMD_NEW_INTERFACE:
+            case NL80211_CMD_DEL_INTERFACE:
+                hit = 1;
+                break;
+            }
+        }
+    }
+    if (!hit) return;
+    stat_inc(&self_stats.wifi_events);
+    flag_raise(&wifi.resolve);
+    if (modules[MOD_WIFI].shown) module_refresh(MOD_WIFI);
+}
+
+static struct watch wifi_events_watch = { -1, wifi_events_cb };
+
+/* without cfg80211 loaded, or on a kernel too old for the groups, the field is only polled */
+static void wifi_events_start(void) {
+    struct nl80211_ids ids;
+    if (nl80211_lookup(&wifi_ev.nl, &ids) < 0) {
+        if (wifi_ev.nl.fd >= 0) close(wifi_ev.nl.fd);
+        wifi_ev.nl.fd = -1;
+        return;
+    }
+    wifi_ev.family = ids.family;
+    int fd = wifi_ev.nl.fd;
+    uint32_t groups[2] = { ids.mlme, ids.config };
+    int joined = 0;
+    for (int i = 0; i < 2; ++i)
+        if (groups[i] && setsockopt(fd, SOL_NETLINK, NETLINK_ADD_MEMBERSHIP, &groups[i], sizeof(groups[i])) == 0)
+            joined++;
+    if (!joined || (wifi_events_watch.fd = fd, watch_add(&wifi_events_watch, EPOLLIN)) < 0) {
+        close(fd);
+        wifi_ev.nl.fd = -1;
+        wifi_events_watch.fd = -1;
+    }
+}
+
+/* ---------- mount table events ---------- */
+
+/* /proc/self/mountinfo polls POLLPRI|POLLERR after every mount or umount */
+static void mounts_cb(struct watch *w, uint32_t events) {
+    (void)w;
+    (void)events;
+    flag_raise(&disk.rescan);
+    if (modules[MOD_DISK].shown) module_refresh(MOD_DISK);
+}
+
+static struct watch mounts_watch = { -1, mounts_cb };
+
+static void mounts_start(void) {
+    char full[512];
+    mounts_watch.fd = open(rooted("/proc/self/mountinfo", full, sizeof(full)), O_RDONLY | O_CLOEXEC);
+    if (mounts_watch.fd >= 0 && watch_add(&mounts_watch, EPOLLPRI) < 0) {
+        close(mounts_watch.fd);
+        mounts_watch.fd = -1;
+    }
+}
+
+/* ---------- memory pressure trigger ---------- */
+
+/* the kernel polls a PSI trigger fd POLLPRI when stalls pass the threshold
+   within the window, at most once per window. Unprivileged triggers need a
+   window that is a multiple of 2 s */
+static void psi_trigger_cb(struct watch *w, uint32_t events) {
+    if (events & EPOLLERR) {            /* the pressure file went away */
+        close(w->fd);
+        w->fd = -1;
+        return;
+    }
+    stat_inc(&self_stats.psi_triggers);
+    if (modules[MOD_MEM].shown) module_refresh(MOD_MEM);
+}
+
+static struct {
+    struct watch w;
+    char spec[CFG_STR];         /* the trigger w.fd was armed with */
+} psi_trigger = { { -1, psi_trigger_cb }, "" };
+
+/* replace the trigger when the spec changed; "" removes it */
+static void psi_trigger_set(const char *spec) {
+    if (psi_trigger.w.fd >= 0 && strcmp(spec, psi_trigger.spec) == 0) return;
+    if (psi_trigger.w.fd >= 0) {
+        close(psi_trigger.w.fd);
+        count_syscalls(1);
+        psi_trigger.w.fd = -1;
+    }
+    snprintf(psi_trigger.spec, sizeof(psi_trigger.spec), "%s", spec);
+    if (!spec[0] || sys_root[0] || tape.replay) return;     /* fixture files are not pressure files */
+
+    char full[512];
+    int fd = open(rooted("/proc/pressure/memory", full, sizeof(full)), O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    count_syscalls(2);
+    if (fd < 0) return;
+    psi_trigger.w.fd = fd;
+    if (write(fd, spec, strlen(spec) + 1) < 0 || watch_add(&psi_trigger.w, EPOLLPRI) < 0) {
+        fprintf(stderr, "intellibar: psi trigger \"%s\": %s\n", spec, strerror(errno));
+        close(fd);
+        psi_trigger.w.fd = -1;
+    }
+}
+
+/* ---------- clock ---------- */
+
+static struct {
+    struct watch timer;
+    char text[64];
+    unsigned text_gen;
+} clock_field = { { -1, NULL }, {0}, 0 };
+
+static void clock_format_at(time_t t) {
+    struct tm tm;
+    localtime_r(&t, &tm);
+    strftime(clock_field.text, sizeof(clock_field.text), "%a, %e %b, %H:%M", &tm);
+}
+
+static void clock_format(void) {
+    time_t now = time(NULL);
+    if (tape.fd >= 0) tape_emit(TAPE_CLOCK, 0, 0, &now, sizeof(now), NULL, 0);
+    clock_format_at(now);
+}
+
+/* fire on every wall-clock minute boundary; a clock jump (NTP step, resume)
+   cancels the timer and we simply re-arm it against the new time */
+static int clock_arm(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = now.tv_sec - now.tv_sec % 60 + 60;
+    its.it_interval.tv_sec = 60;
+    return timerfd_settime(clock_field.timer.fd,
+                           TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET, &its, NULL);
+}
+
+static void clock_timer_cb(struct watch *w, uint32_t events) {
+    (void)events;
+    if (timer_drain(w->fd) == 0) clock_arm();
+    char prev[sizeof(clock_field.text)];
+    memcpy(prev, clock_field.text, sizeof(prev));
+    clock_format();
+    if (strcmp(prev, clock_field.text) != 0) clock_field.text_gen = ++loop.gen;
+}
+
+static int clock_start(void) {
+    clock_field.timer.fd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (clock_field.timer.fd < 0) return -1;
+    clock_field.timer.on_ready = clock_timer_cb;
+    clock_format();
+    if (clock_arm() < 0) return -1;
+    return watch_add(&clock_field.timer, EPOLLIN);
+}
+
+/* ---------- layout and config file ---------- */
+
+/* fields are the modules in MOD_* order (unloaded plugin slots have no
+   name) plus the clock */
+#define FIELD_CLOCK MOD_COUNT
+#define FIELD_COUNT (MOD_COUNT + 1)
+#define FMT_LEN 48
+#define BLOCK_FRAG 768
+
+static const char *const default_format[MOD_PLUGIN] = {
+    "RAM: %s", "CPU: %s", "Temp: %s", "Disk: %s", "%s", "Vol: %s", "🖮  %s", "↯ %s", "Top: %s",
+    "WiFi: %s",
+};
+
+static const char *field_format(int f) {
+    if (f < MOD_PLUGIN) return default_format[f];
+    if (f < MOD_COUNT && modules[f].name && plugins[f - MOD_PLUGIN].def->format)
+        return plugins[f - MOD_PLUGIN].def->format;
+    return "%s";
+}
+
+static const char *field_name(int f) {
+    if (f < MOD_COUNT) return modules[f].name ? modules[f].name : "";
+    return "clock";
+}
+
+static int field_find(const char *name, size_t len) {
+    if (!len) return -1;
+    for (int f = 0; f < FIELD_COUNT; ++f)
+        if (strlen(field_name(f)) == len && strncmp(field_name(f), name, len) == 0) return f;
+    return -1;
+}
+
+/* one field of the compiled output line: fixed text around a pointer to the
+   live field text, so a line is built by copying, not by formatting */
+struct slot {
+    int field;
+    const char *text;           /* module or clock text */
+    const unsigned *gen;        /* ...and the generation it was last changed in */
+    size_t lead_len, pre_len, post_len;
+    char lead[16 + FMT_LEN];    /* prefix or separator, then the format before %s (pre) */
+    char post[FMT_LEN];         /* the format after %s */
+
+    int iov;                    /* index of the text in layout.iov */
+    unsigned line_gen;          /* *gen when its iov_len was last taken */
+
+    /* --json: the serialised block, rebuilt only when *gen moves */
+    unsigned built_gen;
+    size_t widest;              /* chars in the widest full_text so far */
+    char widest_text[256];      /* ...which is sent as min_width so fields do not jitter */
+    size_t len;
+    char frag[BLOCK_FRAG];
+};
+
+/* the plain line as iovecs: lead, text and post of every slot, then "\n".
+   Only a text whose generation moved has its length re-taken */
+static struct {
+    int count;
+    struct slot slots[FIELD_COUNT];
+    int iovcnt;
+    struct iovec iov[FIELD_COUNT * 3 + 1];
+} layout;
+
+static void layout_iov(const char *base, size_t len) {
+    if (!len) return;
+    layout.iov[layout.iovcnt].iov_base = (void *)base;
+    layout.iov[layout.iovcnt].iov_len = len;
+    layout.iovcnt++;
+}
+
+/* a parsed config file, before it is compiled into cfg, intervals and layout */
+struct settings {
+    int order[FIELD_COUNT], count;
+    int interval[MOD_COUNT];
+    char format[FIELD_COUNT][FMT_LEN];
+    char prefix[16], separator[16];
+    char net_iface[CFG_STR], temp_sensor[CFG_STR], disk[CFG_STR], battery[CFG_STR];
+    int disk_io;
+    int cpu_mode;
+    int mem_extra, psi;
+    char psi_trigger[CFG_STR];
+    int top_count, top_by_mem;
+    int governor;
+};
+
+static struct {
+    struct watch dir;           /* inotify on the directory, which survives editors' renames */
+    char path[256];
+    const char *base;
+    struct settings defaults;   /* the compiled-in values */
+} config = { { -1, NULL }, {0}, NULL, {} };
+
+static char *trim(char *p) {
+    while (*p == ' ' || *p == '\t') p++;
+    char *end = p + strlen(p);
+    while (end > p && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\r')) *--end = '\0';
+    return p;
+}
+
+static int parse_int(const char *v, int *out) {
+    char *end;
+    long n = strtol(v, &end, 10);
+    if (end == v || *end || n < 1 || n > 86400) return -1;
+    *out = (int)n;
+    return 0;
+}
+
+static int parse_str(const char *v, char *out, size_t outlen) {
+    return snprintf(out, outlen, "%s", v) < (int)outlen ? 0 : -1;
+}
+
+static int parse_bool(const char *v, int *out) {
+    if (strcmp(v, "yes") != 0 && strcmp(v, "no") != 0) return -1;
+    *out = strcmp(v, "yes") == 0;
+    return 0;
+}
+
+/* "swap cached dirty shmem", any subset in any order */
+static int parse_mem_extra(const char *v, int *out) {
+    static const char *const names[] = { "swap", "cached", "dirty", "shmem" };
+    *out = 0;
+    for (const char *p = v + strspn(v, " \t,"); *p; p += strspn(p, " \t,")) {
+        size_t len = strcspn(p, " \t,");
+        int bit = -1;
+        for (int i = 0; i < 4; ++i)
+            if (strlen(names[i]) == len && strncmp(names[i], p, len) == 0) bit = i;
+        if (bit < 0) return -1;
+        *out |= 1 << bit;
+        p += len;
+    }
+    return 0;
+}
+
+/* "some|full <stall us> <window us>" as the /proc/pressure files take it, or "" */
+static int parse_psi_trigger(const char *v, char *out, size_t outlen) {
+    char kind[8];
+    unsigned long stall, window;
+    int end = 0;
+    if (v[0] && (sscanf(v, "%7s %lu %lu%n", kind, &stall, &window, &end) != 3 || v[end] ||
+                 (strcmp(kind, "some") != 0 && strcmp(kind, "full") != 0) || stall == 0 || stall > window))
+        return -1;
+    return parse_str(v, out, outlen);
+}
+
+/* one "key = value" line; -1 on an unknown key or a bad value */
+static int settings_set(struct settings *st, const char *key, const char *val) {
+    const char *dot = strchr(key, '.');
+    if (dot) {
+        int f = field_find(dot + 1, strlen(dot + 1));
+        if (f < 0) return -1;
+        if (strncmp(key, "interval.", 9) == 0) {
+            if (f >= MOD_COUNT || config.defaults.interval[f] == 0) return -1;     /* event-driven */
+            return parse_int(val, &st->interval[f]);
+        }
+        if (strncmp(key, "format.", 7) == 0) {
+            if (!strstr(val, "%s")) return -1;
+            return parse_str(val, st->format[f], sizeof(st->format[f]));
+        }
+        return -1;
+    }
+    if (strcmp(key, "modules") == 0) {
+        st->count = 0;
+        int seen[FIELD_COUNT] = {0};
+        for (const char *p = val; *p;) {
+            size_t len = strcspn(p, " \t,");
+            if (len) {
+                int f = field_find(p, len);
+                if (f < 0) return -1;
+                if (!seen[f]) st->order[st->count++] = f;
+                seen[f] = 1;
+            }
+            p += len;
+            p += strspn(p, " \t,");
+        }
+        return 0;
+    }
+    if (strcmp(key, "interval") == 0) {
+        int n;
+        if (parse_int(val, &n) < 0) return -1;
+        for (int i = 0; i < MOD_COUNT; ++i)
+            if (config.defaults.interval[i] == STATS_INTERVAL) st->interval[i] = n;
+        return 0;
+    }
+    if (strcmp(key, "prefix") == 0) return parse_str(val, st->prefix, sizeof(st->prefix));
+    if (strcmp(key, "separator") == 0) return parse_str(val, st->separator, sizeof(st->separator));
+    if (strcmp(key, "net_iface") == 0) return parse_str(val, st->net_iface, sizeof(st->net_iface));
+    if (strcmp(key, "temp_sensor") == 0) return parse_str(val, st->temp_sensor, sizeof(st->temp_sensor));
+    if (strcmp(key, "disk") == 0) return parse_str(val, st->disk, sizeof(st->disk));
+    if (strcmp(key, "disk_io") == 0) return parse_bool(val, &st->disk_io);
+    if (strcmp(key, "battery") == 0) return parse_str(val, st->battery, sizeof(st->battery));
+    if (strcmp(key, "cpu") == 0) {
+        static const char *const modes[] = { "total", "maxcore", "cores", "iowait" };     /* CPU_SHOW_* order */
+        for (int i = 0; i < (int)(sizeof(modes) / sizeof(modes[0])); ++i) {
+            if (strcmp(val, modes[i]) != 0) continue;
+            st->cpu_mode = i;
+            return 0;
+        }
+        return -1;
+    }
+    if (strcmp(key, "mem_extra") == 0) return parse_mem_extra(val, &st->mem_extra);
+    if (strcmp(key, "psi") == 0) return parse_bool(val, &st->psi);
+    if (strcmp(key, "psi_trigger") == 0) return parse_psi_trigger(val, st->psi_trigger, sizeof(st->psi_trigger));
+    if (strcmp(key, "top") == 0) {
+        if (strcmp(val, "cpu") != 0 && strcmp(val, "mem") != 0) return -1;
+        st->top_by_mem = strcmp(val, "mem") == 0;
+        return 0;
+    }
+    if (strcmp(key, "top_count") == 0) {
+        int n;
+        if (parse_int(val, &n) < 0 || n > TOP_MAX) return -1;
+        st->top_count = n;
+        return 0;
+    }
+    if (strcmp(key, "governor") == 0) return parse_bool(val, &st->governor);
+    return -1;
 }
 
-/* ---------- Disk ---------- */
+/* "#" comments, "key = value", values optionally in double quotes to keep
+   leading or trailing spaces; bad lines are reported and skipped */
+static void settings_parse(struct settings *st, char *text) {
+    int lineno = 0;
+    for (char *line = text, *next; line; line = next) {
+        next = strchr(line, '\n');
+        if (next) *next++ = '\0';
+        lineno++;
 
-static void get_disk(char *out, size_t outlen) {
-    struct statvfs st;
-    if (statvfs("/", &st) != 0) {
-        snprintf(out, outlen, "N/A");
-        return;
+        char *p = trim(line);
+        if (!*p || *p == '#') continue;
+        char *eq = strchr(p, '=');
+        if (!eq) {
+            fprintf(stderr, "intellibar: %s:%d: expected key = value\n", config.path, lineno);
+            continue;
+        }
+        *eq = '\0';
+        char *key = trim(p), *val = trim(eq + 1);
+        size_t vlen = strlen(val);
+        if (vlen >= 2 && val[0] == '"' && val[vlen - 1] == '"') {
+            val[vlen - 1] = '\0';
+            val++;
+        }
+        if (settings_set(st, key, val) < 0)
+            fprintf(stderr, "intellibar: %s:%d: bad setting '%s'\n", config.path, lineno, key);
     }
-    long long avail = (long long)st.f_bavail * st.f_frsize / (1024LL * 1024LL * 1024LL);
-    long long total = (long long)st.f_blocks * st.f_frsize / (1024LL * 1024LL * 1024LL);
-    snprintf(out, outlen, "%3lldGi/%3lldGi", avail, total);
 }
 
-/* ---------- CPU ---------- */
+static void layout_compile(const struct settings *st) {
+    memset(&layout, 0, sizeof(layout));
+    for (int k = 0; k < st->count; ++k) {
+        int f = st->order[k];
+        struct slot *sl = &layout.slots[layout.count++];
+        sl->field = f;
+        sl->text = f < MOD_COUNT ? modules[f].text : clock_field.text;
+        sl->gen = f < MOD_COUNT ? &modules[f].text_gen : &clock_field.text_gen;
 
-static void get_cpu_usage(char *out, size_t outlen) {
-    static long long prev_total = 0, prev_active = 0;
+        const char *fmt = st->format[f];
+        const char *hole = strstr(fmt, "%s");
+        int n = snprintf(sl->lead, sizeof(sl->lead), "%s%.*s", k ? st->separator : st->prefix,
+                         (int)(hole - fmt), fmt);
+        sl->lead_len = (size_t)n < sizeof(sl->lead) ? (size_t)n : sizeof(sl->lead) - 1;
+        sl->pre_len = (size_t)(hole - fmt);
+        snprintf(sl->post, sizeof(sl->post), "%s", hole + 2);
+        sl->post_len = strlen(sl->post);
 
-    char buf[256];
-    read_file("/proc/stat", buf, sizeof(buf));
-    long long u, n, s, i, w, x, y, z;
-    char label[16];
-    if (sscanf(buf, "%15s %lld %lld %lld %lld %lld %lld %lld %lld",
-               label, &u, &n, &s, &i, &w, &x, &y, &z) != 9) {
-        snprintf(out, outlen, "  0%%");
-        return;
+        layout_iov(sl->lead, sl->lead_len);
+        sl->iov = layout.iovcnt++;
+        sl->line_gen = *sl->gen - 1;
+        layout_iov(sl->post, sl->post_len);
     }
+    layout_iov("\n", 1);
+}
 
-    long long total = u + n + s + i + w + x + y + z;
-    long long active = u + n + s + w + x + y + z;
-
-    if (prev_total == 0) {
-        prev_total = total;
-        prev_active = active;
-        snprintf(out, outlen, "  0%%");
-        return;
+static void config_apply(const struct settings *st) {
+    pthread_mutex_lock(&cfg.lock);
+    int iface = strcmp(cfg.net_iface, st->net_iface) != 0;
+    int sensor = strcmp(cfg.temp_sensor, st->temp_sensor) != 0;
+    int battery = strcmp(cfg.battery, st->battery) != 0;
+    int mounts = strcmp(cfg.disk, st->disk) != 0;
+    memcpy(cfg.net_iface, st->net_iface, sizeof(cfg.net_iface));
+    memcpy(cfg.temp_sensor, st->temp_sensor, sizeof(cfg.temp_sensor));
+    memcpy(cfg.disk, st->disk, sizeof(cfg.disk));
+    memcpy(cfg.battery, st->battery, sizeof(cfg.battery));
+    __atomic_store_n(&cfg.disk_io, st->disk_io, __ATOMIC_RELAXED);
+    __atomic_store_n(&cfg.cpu_mode, st->cpu_mode, __ATOMIC_RELAXED);
+    __atomic_store_n(&cfg.mem_extra, st->mem_extra, __ATOMIC_RELAXED);
+    __atomic_store_n(&cfg.psi, st->psi, __ATOMIC_RELAXED);
+    __atomic_store_n(&cfg.top_count, st->top_count, __ATOMIC_RELAXED);
+    __atomic_store_n(&cfg.top_by_mem, st->top_by_mem, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&cfg.lock);
+    if (mounts) flag_raise(&disk.rescan);
+    if (iface) {
+        flag_raise(&net.resolve);
+        flag_raise(&wifi.resolve);
     }
+    if (sensor) flag_raise(&temp_cache.rescan);
+    if (battery) flag_raise(&batt.rescan);
+    psi_trigger_set(st->psi_trigger);
 
-    long long diff_t = total - prev_total;
-    long long diff_a = active - prev_active;
-    prev_total = total;
-    prev_active = active;
+    layout_compile(st);
+    int shown[MOD_COUNT] = {0};
+    for (int k = 0; k < layout.count; ++k)
+        if (layout.slots[k].field < MOD_COUNT) shown[layout.slots[k].field] = 1;
 
-    int pct = 0;
-    if (diff_t > 0) {
-        pct = (int)(100 * diff_a / diff_t);
-        if (pct < 0) pct = 0;
-        if (pct > 100) pct = 100;
+    /* before modules_start this only records intervals and visibility */
+    for (int i = 0; i < MOD_COUNT; ++i) {
+        struct module *m = &modules[i];
+        int appear = shown[i] && !m->shown;
+        int rearm = shown[i] != m->shown || m->interval != st->interval[i];
+        m->shown = shown[i];
+        m->interval = st->interval[i];
+        if (!m->timer.on_ready) continue;
+        if (rearm) module_arm(m);
+        if (appear) module_refresh(i);
+    }
+    int toggled = gov.enabled != st->governor;
+    gov.enabled = st->governor;
+    gov_update(toggled);
+    loop.gen++;
+    stat_inc(&self_stats.config_loads);
+}
+
+static void config_load(void) {
+    struct settings st = config.defaults;
+    char text[8192] = "";
+    int fd = open(config.path, O_RDONLY | O_CLOEXEC);
+    count_syscalls(1);
+    if (fd >= 0) {
+        size_t off = 0;
+        ssize_t n;
+        while (off + 1 < sizeof(text) && ((n = read(fd, text + off, sizeof(text) - 1 - off)) > 0 ||
+                                          (n < 0 && errno == EINTR)))
+            if (n > 0) off += (size_t)n;
+        close(fd);
+        count_syscalls(2);
+        text[off] = '\0';
     }
-    snprintf(out, outlen, "%3d%%", pct);
-}
-
-/* ---------- Net ---------- */
-
-static void get_net_speed(char *out, size_t outlen) {
-    static long long prev_rx = 0, prev_tx = 0;
-
-    char buf[2048];
-    read_file("/proc/net/dev", buf, sizeof(buf));
-    char *p = buf;
-    long long rx = 0, tx = 0;
-    while (*p) {
-        while (*p == ' ' || *p == '\n') p++;
-        if (!*p) break;
-        char *line = p;
-        while (*p && *p != '\n') p++;
-        if (*p == '\n') *p++ = '\0';
-
-        char *colon = strchr(line, ':');
-        if (!colon) continue;
-        *colon = '\0';
-        char *iface = line;
-        while (*iface == ' ') iface++;
-        if (strcmp(iface, NET_IFACE) != 0) continue;
-
-        char *stats = colon + 1;
-        long long vals[16];
-        int n = 0;
-        char *q = stats;
-        while (*q && n < 16) {
-            while (*q == ' ') q++;
-            if (!*q) break;
-            char *end = q;
-            while (*end && *end != ' ') end++;
-            char tmp = *end;
-            *end = '\0';
-            vals[n++] = atoll(q);
-            *end = tmp;
-            q = end;
-        }
-        if (n >= 9) {
-            rx = vals[0];
-            tx = vals[8];
+    if (tape.fd >= 0) tape_emit(TAPE_CONFIG, 0, 0, text, strlen(text) + 1, NULL, 0);
+    settings_parse(&st, text);
+    config_apply(&st);
+}
+
+static void config_cb(struct watch *w, uint32_t events) {
+    (void)events;
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    int hit = 0;
+    ssize_t n;
+    while ((n = read(w->fd, buf, sizeof(buf))) > 0) {
+        count_syscalls(1);
+        for (char *p = buf; p < buf + n;) {
+            const struct inotify_event *ev = (const struct inotify_event *)p;
+            if (ev->len && strcmp(ev->name, config.base) == 0) hit = 1;
+            p += sizeof(*ev) + ev->len;
         }
-        break;
     }
+    count_syscalls(1);
+    if (hit) config_load();
+}
 
-    if (prev_rx == 0) {
-        prev_rx = rx;
-        prev_tx = tx;
-        snprintf(out, outlen, "↓    0 KiB/s ↑   0 KiB/s");
-        return;
+static void settings_defaults(struct settings *d) {
+    d->count = 0;
+    for (int f = 0; f < FIELD_COUNT; ++f) {
+        if (f != MOD_TOP && f != MOD_WIFI && field_name(f)[0])
+            d->order[d->count++] = f;       /* top and wifi are opt-in via modules */
+        snprintf(d->format[f], sizeof(d->format[f]), "%s", field_format(f));
     }
+    for (int i = 0; i < MOD_COUNT; ++i) d->interval[i] = modules[i].interval;
+    snprintf(d->prefix, sizeof(d->prefix), "| ");
+    snprintf(d->separator, sizeof(d->separator), " | ");
+    memcpy(d->net_iface, cfg.net_iface, sizeof(d->net_iface));
+    memcpy(d->temp_sensor, cfg.temp_sensor, sizeof(d->temp_sensor));
+    memcpy(d->disk, cfg.disk, sizeof(d->disk));
+    memcpy(d->battery, cfg.battery, sizeof(d->battery));
+    d->disk_io = cfg.disk_io;
+    d->cpu_mode = cfg.cpu_mode;
+    d->mem_extra = cfg.mem_extra;
+    d->psi = cfg.psi;
+    snprintf(d->psi_trigger, sizeof(d->psi_trigger), "%s", PSI_TRIGGER);
+    d->top_count = cfg.top_count;
+    d->top_by_mem = cfg.top_by_mem;
+    d->governor = GOVERNOR;
+}
 
-    long long drx = (rx - prev_rx) / (1024 * STATS_INTERVAL);
-    long long dtx = (tx - prev_tx) / (1024 * STATS_INTERVAL);
-    prev_rx = rx;
-    prev_tx = tx;
-    if (drx < 0) drx = 0;
-    if (dtx < 0) dtx = 0;
+/* $XDG_CONFIG_HOME/intellibar/config (or ~/.config/...) unless --config gave one;
+   a missing file means the compiled-in defaults */
+static void config_start(void) {
+    settings_defaults(&config.defaults);
+    if (!config.path[0]) {
+        const char *xdg = getenv("XDG_CONFIG_HOME"), *home = getenv("HOME");
+        if (xdg && *xdg) snprintf(config.path, sizeof(config.path), "%s/intellibar/config", xdg);
+        else if (home && *home) snprintf(config.path, sizeof(config.path), "%s/.config/intellibar/config", home);
+    }
+    config_load();
 
-    snprintf(out, outlen, "↓%5lld KiB/s ↑%4lld KiB/s", drx, dtx);
+    char *slash = strrchr(config.path, '/');
+    if (!slash) return;
+    config.base = slash + 1;
+    config.dir.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    config.dir.on_ready = config_cb;
+    if (config.dir.fd < 0) return;
+    *slash = '\0';
+    int wd = inotify_add_watch(config.dir.fd, config.path[0] ? config.path : "/",
+                               IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE);
+    *slash = '/';
+    if (wd < 0 || watch_add(&config.dir, EPOLLIN) < 0) {
+        close(config.dir.fd);
+        config.dir.fd = -1;
+    }
 }
 
-/* ---------- Temp ---------- */
+/* ---------- output ---------- */
 
-static void get_temp(char *out, size_t outlen) {
-    int max_temp = 0;
-    char path[128], buf[32];
-    for (int i = 0; i < 15; ++i) {
-        for (int j = 1; j <= 10; ++j) {
-            snprintf(path, sizeof(path), "/sys/class/hwmon/hwmon%d/temp%d_input", i, j);
-            int fd = open(path, O_RDONLY);
-            if (fd < 0) continue;
-            ssize_t n = read(fd, buf, sizeof(buf) - 1);
-            close(fd);
-            if (n <= 0) continue;
-            buf[n] = '\0';
-            int t = atoi(buf);
-            if (t > 1000000) t /= 1000000;
-            else if (t > 1000) t /= 1000;
-            if (t > 0 && t < 150 && t > max_temp) max_temp = t;
-        }
-    }
-    if (max_temp <= 0) snprintf(out, outlen, "N/A");
-    else snprintf(out, outlen, "%3d°C", max_temp);
-}
-
-/* ---------- Battery via /sys ---------- */
-
-static void get_battery(char *out, size_t outlen) {
-    char path[128], buf[64];
-    struct stat st;
-    if (stat("/sys/class/power_supply/BAT0", &st) != 0) {
-        snprintf(out, outlen, "N/A N/A");
-        return;
+static void write_all(int fd, const char *buf, size_t len) {
+    size_t off = 0;
+    while (off < len) {
+        ssize_t w = write(fd, buf + off, len - off);
+        count_syscalls(1);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            return;
+        }
+        off += (size_t)w;
     }
+}
 
-    snprintf(path, sizeof(path), "/sys/class/power_supply/BAT0/status");
-    read_file(path, buf, sizeof(buf));
-    trim_newline(buf);
-    char state[5] = "BATT";
-    if (strstr(buf, "Charging"))  strcpy(state, "CHRG");
-    else if (strstr(buf, "Full")) strcpy(state, "FULL");
+/* a short writev is finished from a copy, the compiled iovecs stay intact */
+static void writev_all(int fd, const struct iovec *iov, int cnt) {
+    ssize_t w;
+    do {
+        w = writev(fd, iov, cnt);
+        count_syscalls(1);
+    } while (w < 0 && errno == EINTR);
+    if (w < 0) return;
 
-    snprintf(path, sizeof(path), "/sys/class/power_supply/BAT0/capacity");
-    read_file(path, buf, sizeof(buf));
-    trim_newline(buf);
-    if (buf[0] == '\0') {
-        snprintf(out, outlen, "N/A N/A");
-        return;
+    struct iovec rest[FIELD_COUNT * 3 + 1];
+    int n = 0;
+    for (int i = 0; i < cnt && n < (int)(sizeof(rest) / sizeof(rest[0])); ++i) {
+        if ((size_t)w >= iov[i].iov_len) {
+            w -= (ssize_t)iov[i].iov_len;
+            continue;
+        }
+        rest[n].iov_base = (char *)iov[i].iov_base + w;
+        rest[n].iov_len = iov[i].iov_len - (size_t)w;
+        w = 0;
+        n++;
     }
-
-    char perc[8];
-    snprintf(perc, sizeof(perc), "%s%%", buf);
-    snprintf(out, outlen, "%s %s", state, perc);
+    if (n) writev_all(fd, rest, n);
 }
 
-/* ---------- Audio via libpulse (persistent threaded mainloop, default sink, cache, timeouts) ---------- */
+/* ---- swaybar JSON protocol (--json) ---- */
 
-#define PA_CACHE_TTL_SEC 2
-#define PA_OP_TIMEOUT_MS 400
-#define PA_INIT_TIMEOUT_MS 2000
-#define PA_SERVERINFO_TIMEOUT_MS 500
+#define COLOR_WARN "#FFA500"
+#define COLOR_CRIT "#FF7373"
 
 static struct {
-    pa_threaded_mainloop *ml;
-    pa_context *ctx;
-    int initialized;
-    char default_sink[256];
-    char cached_vol[16];
-    time_t cached_at;
-} pa_handle = { NULL, NULL, 0, {0}, "0%%", 0 };
+    int fd;                     /* stdout; /dev/null under --bench */
+    int json;
+} output = { 1, 0 };
 
-struct pa_vol_ctx {
-    int done;
-    char vol[16];
-};
-
-/* callbacks: mainloop lock is already held by PulseAudio when these run */
-
-static void pa_state_cb(pa_context *c, void *userdata) {
-    (void)c;
-    pa_threaded_mainloop *ml = (pa_threaded_mainloop *)userdata;
-    pa_threaded_mainloop_signal(ml, 0);
+static size_t utf8_chars(const char *s) {
+    size_t n = 0;
+    for (; *s; ++s)
+        if (((unsigned char)*s & 0xc0) != 0x80) n++;
+    return n;
 }
 
-static void pa_server_info_cb(pa_context *c, const pa_server_info *i, void *userdata) {
-    (void)c;
-    pa_threaded_mainloop *ml = (pa_threaded_mainloop *)userdata;
-    if (i && i->default_sink_name) {
-        strncpy(pa_handle.default_sink, i->default_sink_name,
-                sizeof(pa_handle.default_sink) - 1);
-        pa_handle.default_sink[sizeof(pa_handle.default_sink) - 1] = '\0';
+/* append s as a JSON string body; stops short rather than overflowing */
+static size_t json_escape(char *out, size_t off, size_t outlen, const char *s) {
+    for (; *s; ++s) {
+        unsigned char c = (unsigned char)*s;
+        if (c == '"' || c == '\\') {
+            if (off + 3 > outlen) break;
+            out[off++] = '\\';
+            out[off++] = (char)c;
+        } else if (c < 0x20) {
+            if (off + 7 > outlen) break;
+            off += (size_t)snprintf(out + off, outlen - off, "\\u%04x", c);
+        } else {
+            if (off + 2 > outlen) break;
+            out[off++] = (char)c;
+        }
     }
-    pa_threaded_mainloop_signal(ml, 0);
+    out[off] = '\0';
+    return off;
 }
 
-static void pa_sink_info_cb(pa_context *c, const pa_sink_info *i, int eol, void *userdata) {
-    (void)c;
-    struct pa_vol_ctx *ctx = (struct pa_vol_ctx *)userdata;
-
-    if (eol > 0 || !i) {
-        if (!ctx->done) {
-            snprintf(ctx->vol, sizeof(ctx->vol), "0%%");
-            ctx->done = 1;
-        }
-        pa_threaded_mainloop_signal(pa_handle.ml, 0);
-        return;
+static void block_build(struct slot *sl, unsigned gen) {
+    char full[sizeof(sl->widest_text)];
+    const char *color = NULL;
+    if (sl->field < MOD_COUNT) {
+        const struct module *m = &modules[sl->field];
+        if (!m->stale && m->level == LEVEL_WARN) color = COLOR_WARN;
+        if (!m->stale && m->level == LEVEL_CRIT) color = COLOR_CRIT;
     }
-
-    if (!ctx->done) {
-        pa_volume_t v = pa_cvolume_avg(&i->volume);
-        int pct = (int)((100 * (long long)v) / PA_VOLUME_NORM);
-        if (pct < 0) pct = 0;
-        if (pct > 150) pct = 150;
-        snprintf(ctx->vol, sizeof(ctx->vol), "%d%%", pct);
-        ctx->done = 1;
+    snprintf(full, sizeof(full), "%.*s%s%s", (int)sl->pre_len, sl->lead + sl->lead_len - sl->pre_len,
+             sl->text, sl->post);
+    size_t chars = utf8_chars(full);
+    if (chars > sl->widest) {
+        sl->widest = chars;
+        snprintf(sl->widest_text, sizeof(sl->widest_text), "%s", full);
     }
-    pa_threaded_mainloop_signal(pa_handle.ml, 0);
-}
-
-static void fini_pulseaudio(void) {
-    if (!pa_handle.initialized) return;
-    pa_threaded_mainloop_lock(pa_handle.ml);
-    pa_context_disconnect(pa_handle.ctx);
-    pa_threaded_mainloop_unlock(pa_handle.ml);
-
-    pa_threaded_mainloop_stop(pa_handle.ml);
-    pa_context_unref(pa_handle.ctx);
-    pa_threaded_mainloop_free(pa_handle.ml);
 
-    pa_handle.ctx = NULL;
-    pa_handle.ml = NULL;
-    pa_handle.initialized = 0;
-    pa_handle.default_sink[0] = '\0';
-    pa_handle.cached_vol[0] = '\0';
-    pa_handle.cached_at = 0;
+    size_t off = (size_t)snprintf(sl->frag, sizeof(sl->frag), "{\"name\":\"%s\",\"full_text\":\"",
+                                  field_name(sl->field));
+    off = json_escape(sl->frag, off, sizeof(sl->frag), full);
+    if (color)
+        off += (size_t)snprintf(sl->frag + off, sizeof(sl->frag) - off, "\",\"color\":\"%s", color);
+    off += (size_t)snprintf(sl->frag + off, sizeof(sl->frag) - off, "\",\"min_width\":\"");
+    off = json_escape(sl->frag, off, sizeof(sl->frag), sl->widest_text);
+    off += (size_t)snprintf(sl->frag + off, sizeof(sl->frag) - off, "\"}");
+    sl->len = off < sizeof(sl->frag) ? off : sizeof(sl->frag) - 1;
+    sl->built_gen = gen;
+    self_stats.blocks_built++;
 }
 
-static int init_pulseaudio(void) {
-    if (pa_handle.initialized) return 0;
-
-    pa_handle.ml = pa_threaded_mainloop_new();
-    if (!pa_handle.ml) return -1;
-
-    pa_mainloop_api *api = pa_threaded_mainloop_get_api(pa_handle.ml);
-    pa_handle.ctx = pa_context_new(api, "intellibar");
-    if (!pa_handle.ctx) {
-        pa_threaded_mainloop_free(pa_handle.ml);
-        pa_handle.ml = NULL;
-        return -1;
+static void flush_json(void) {
+    struct iovec iov[FIELD_COUNT * 2 + 1];
+    int n = 0;
+    for (int i = 0; i < layout.count; ++i) {
+        struct slot *sl = &layout.slots[i];
+        if (sl->len == 0 || sl->built_gen != *sl->gen) block_build(sl, *sl->gen);
+        iov[n].iov_base = (void *)(i ? "," : "[");
+        iov[n++].iov_len = 1;
+        iov[n].iov_base = sl->frag;
+        iov[n++].iov_len = sl->len;
     }
+    iov[n].iov_base = (void *)(layout.count ? "],\n" : "[],\n");
+    iov[n].iov_len = layout.count ? 3 : 4;
+    writev_all(output.fd, iov, n + 1);
+}
 
-    pa_context_set_state_callback(pa_handle.ctx, pa_state_cb, pa_handle.ml);
+/* swaybar writes "[" and then one click object per line, each after the
+   first prefixed with a comma */
+static struct {
+    struct watch in;
+    size_t len;
+    char buf[1024];
+} click = { { -1, NULL }, 0, {0} };
 
-    if (pa_threaded_mainloop_start(pa_handle.ml) != 0) {
-        pa_context_unref(pa_handle.ctx);
-        pa_threaded_mainloop_free(pa_handle.ml);
-        pa_handle.ctx = NULL;
-        pa_handle.ml = NULL;
-        return -1;
-    }
+static void click_dispatch(const char *line) {
+    char name[32], tmp[8];
+    if (!json_str_field(line, "\"name\"", name, sizeof(name)) || !name[0]) return;
+    const char *button = json_str_field(line, "\"button\"", tmp, sizeof(tmp));
+    self_stats.clicks++;
+    if (io_stats.trace)
+        fprintf(stderr, "intellibar: click %s button %d\n", name, button ? atoi(button) : 0);
 
-    pa_threaded_mainloop_lock(pa_handle.ml);
-    if (pa_context_connect(pa_handle.ctx, NULL, PA_CONTEXT_NOFLAGS, NULL) < 0) {
-        pa_threaded_mainloop_unlock(pa_handle.ml);
-        pa_threaded_mainloop_stop(pa_handle.ml);
-        pa_context_unref(pa_handle.ctx);
-        pa_threaded_mainloop_free(pa_handle.ml);
-        pa_handle.ctx = NULL;
-        pa_handle.ml = NULL;
-        return -1;
+    /* any button re-samples the field at once */
+    int f = field_find(name, strlen(name));
+    if (f >= 0 && f < MOD_COUNT && modules[f].shown) module_refresh(f);
+}
+
+static void click_cb(struct watch *w, uint32_t events) {
+    (void)events;
+    ssize_t n = read(w->fd, click.buf + click.len, sizeof(click.buf) - 1 - click.len);
+    count_syscalls(1);
+    if (n < 0 && (errno == EAGAIN || errno == EINTR)) return;
+    if (n <= 0) {
+        /* stdin closed; swaybar is gone or never sent clicks */
+        epoll_ctl(loop.epfd, EPOLL_CTL_DEL, w->fd, NULL);
+        count_syscalls(1);
+        return;
     }
+    click.len += (size_t)n;
+    click.buf[click.len] = '\0';
 
-    struct timespec start;
-    clock_gettime(CLOCK_MONOTONIC, &start);
-    for (;;) {
-        pa_context_state_t st = pa_context_get_state(pa_handle.ctx);
-        if (st == PA_CONTEXT_READY) break;
-        if (st == PA_CONTEXT_FAILED || st == PA_CONTEXT_TERMINATED) {
-            pa_threaded_mainloop_unlock(pa_handle.ml);
-            pa_threaded_mainloop_stop(pa_handle.ml);
-            pa_context_unref(pa_handle.ctx);
-            pa_threaded_mainloop_free(pa_handle.ml);
-            pa_handle.ctx = NULL;
-            pa_handle.ml = NULL;
-            return -1;
-        }
-        struct timespec now;
-        clock_gettime(CLOCK_MONOTONIC, &now);
-        long elapsed_ms = (now.tv_sec - start.tv_sec) * 1000 +
-                          (now.tv_nsec - start.tv_nsec) / 1000000;
-        if (elapsed_ms >= PA_INIT_TIMEOUT_MS) {
-            fprintf(stderr, "intellibar: pulseaudio init timeout\n");
-            pa_threaded_mainloop_unlock(pa_handle.ml);
-            pa_threaded_mainloop_stop(pa_handle.ml);
-            pa_context_unref(pa_handle.ctx);
-            pa_threaded_mainloop_free(pa_handle.ml);
-            pa_handle.ctx = NULL;
-            pa_handle.ml = NULL;
-            return -1;
-        }
-        pa_threaded_mainloop_wait(pa_handle.ml);
+    char *line = click.buf, *nl;
+    while ((nl = strchr(line, '\n')) != NULL) {
+        *nl = '\0';
+        click_dispatch(line);
+        line = nl + 1;
     }
+    click.len = strlen(line);
+    if (click.len == sizeof(click.buf) - 1) click.len = 0;     /* oversized line: drop it */
+    memmove(click.buf, line, click.len);
+}
 
-    pa_threaded_mainloop_unlock(pa_handle.ml);
+static void json_start(void) {
+    static const char header[] = "{\"version\":1,\"click_events\":true}\n[\n";
+    write_all(output.fd, header, sizeof(header) - 1);
 
-    atexit(fini_pulseaudio);
-    pa_handle.initialized = 1;
-    return 0;
+    click.in.fd = 0;
+    click.in.on_ready = click_cb;
+    fcntl(0, F_SETFL, fcntl(0, F_GETFL) | O_NONBLOCK);
+    watch_add(&click.in, EPOLLIN);      /* fails harmlessly when stdin is a plain file */
 }
 
-/* refresh default sink name (used when cache is stale) */
-static void refresh_default_sink(void) {
-    if (!pa_handle.initialized || !pa_handle.ml) return;
-
-    pa_operation *op = NULL;
-    struct timespec start;
+/* swaybar redraws on every line it receives, so only emit when a field or
+   the minute changed since the last write */
+static void flush_line(void) {
+    if (loop.gen == loop.flushed_gen) return;
 
-    pa_threaded_mainloop_lock(pa_handle.ml);
-    pa_handle.default_sink[0] = '\0';
+    /* hold the first line until every field has produced something */
+    for (int i = 0; i < layout.count; ++i)
+        if (!layout.slots[i].text[0]) return;
+    loop.flushed_gen = loop.gen;
 
-    op = pa_context_get_server_info(pa_handle.ctx, pa_server_info_cb, pa_handle.ml);
-    if (!op) {
-        pa_threaded_mainloop_unlock(pa_handle.ml);
+    if (output.json) {
+        flush_json();
+        self_stats.lines++;
         return;
     }
 
-    clock_gettime(CLOCK_MONOTONIC, &start);
-    while (pa_operation_get_state(op) == PA_OPERATION_RUNNING &&
-           pa_handle.default_sink[0] == '\0') {
-        struct timespec now;
-        clock_gettime(CLOCK_MONOTONIC, &now);
-        long elapsed_ms = (now.tv_sec - start.tv_sec) * 1000 +
-                          (now.tv_nsec - start.tv_nsec) / 1000000;
-        if (elapsed_ms >= PA_SERVERINFO_TIMEOUT_MS) break;
-        pa_threaded_mainloop_wait(pa_handle.ml);
+    /* the layout is precompiled: point at the changed texts and hand the
+       whole line to the kernel, no formatting or copying */
+    for (int i = 0; i < layout.count; ++i) {
+        struct slot *sl = &layout.slots[i];
+        if (sl->line_gen == *sl->gen) continue;
+        layout.iov[sl->iov].iov_base = (void *)sl->text;
+        layout.iov[sl->iov].iov_len = strlen(sl->text);
+        sl->line_gen = *sl->gen;
     }
-    pa_operation_unref(op);
-    pa_threaded_mainloop_unlock(pa_handle.ml);
+    writev_all(output.fd, layout.iov, layout.iovcnt);
+    self_stats.lines++;
 }
 
-/* get_audio: short cache, refresh default sink on cache miss, timeout per op */
-static void get_audio(char *out, size_t outlen) {
-    time_t now = time(NULL);
+/* ---------- self stats ---------- */
 
-    if (pa_handle.cached_at != 0 &&
-        now - pa_handle.cached_at <= PA_CACHE_TTL_SEC &&
-        pa_handle.cached_vol[0]) {
-        snprintf(out, outlen, "%4s", pa_handle.cached_vol);
-        return;
-    }
+/* what the bar costs: `kill -USR1 <pid>` dumps to stderr, connecting to
+   $XDG_RUNTIME_DIR/intellibar.sock (e.g. socat - UNIX-CONNECT:...) returns the same text */
+static struct {
+    struct watch sig;           /* signalfd for SIGUSR1 */
+    struct watch listen;        /* stats socket */
+    char path[108];
+    long long started_ms;
+} stats_io = { { -1, NULL }, { -1, NULL }, {0}, 0 };
 
-    if (init_pulseaudio() != 0) {
-        snprintf(out, outlen, "0%%");
-        return;
-    }
+#define LD(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
 
-    refresh_default_sink();
+static size_t stats_format(char *buf, size_t buflen) {
+    size_t off = 0;
+#define OUT(...) do { \
+        int n_ = snprintf(buf + off, buflen - off, __VA_ARGS__); \
+        if (n_ > 0) off += (size_t)n_ < buflen - off ? (size_t)n_ : buflen - off - 1; \
+    } while (0)
 
-    struct pa_vol_ctx vctx;
-    vctx.done = 0;
-    snprintf(vctx.vol, sizeof(vctx.vol), "0%%");
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    double cpu = (double)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) +
+                 (double)(ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+    double up = (double)(now_ms() - stats_io.started_ms) / 1000.0;
+    if (up <= 0) up = 1e-3;
 
-    pa_operation *op = NULL;
-    struct timespec start;
+    long rss_pages = 0;
+    char statm[128];
+    struct source src = SOURCE("/proc/self/statm");
+    if (source_read(&src, statm, sizeof(statm)) > 0) sscanf(statm, "%*s %ld", &rss_pages);
+    source_close(&src);
 
-    pa_threaded_mainloop_lock(pa_handle.ml);
-    if (pa_handle.default_sink[0]) {
-        op = pa_context_get_sink_info_by_name(pa_handle.ctx,
-                                              pa_handle.default_sink,
-                                              pa_sink_info_cb, &vctx);
-    } else {
-        op = pa_context_get_sink_info_list(pa_handle.ctx,
-                                           pa_sink_info_cb, &vctx);
-    }
-
-    if (op) {
-        clock_gettime(CLOCK_MONOTONIC, &start);
-        while (pa_operation_get_state(op) == PA_OPERATION_RUNNING &&
-               !vctx.done) {
-            struct timespec nowts;
-            clock_gettime(CLOCK_MONOTONIC, &nowts);
-            long elapsed_ms = (nowts.tv_sec - start.tv_sec) * 1000 +
-                              (nowts.tv_nsec - start.tv_nsec) / 1000000;
-            if (elapsed_ms >= PA_OP_TIMEOUT_MS) {
-                pa_operation_cancel(op);
-                break;
-            }
-            pa_threaded_mainloop_wait(pa_handle.ml);
+    OUT("intellibar pid %d up %.0fs cpu %.3fs (%.4f%%) rss %ldKiB maxrss %ldKiB\n",
+        (int)getpid(), up, cpu, 100.0 * cpu / up,
+        rss_pages * (sysconf(_SC_PAGESIZE) / 1024), ru.ru_maxrss);
+    unsigned long woken = wakeups_total();
+    OUT("wakeups %lu (%.1f/min): reactor %lu, workers %lu for %lu jobs\n",
+        woken, 60.0 * (double)woken / up, io_stats.ticks, LD(io_stats.worker_wakeups), LD(io_stats.jobs));
+    OUT("lines %lu syscalls %lu (%.1f/wakeup) workers %d\n", self_stats.lines, LD(self_stats.syscalls_total),
+        woken ? (double)LD(self_stats.syscalls_total) / (double)woken : 0.0, pool.threads);
+    OUT("sources hits %lu opens %lu reopens %lu, hwmon rescans %lu, rtnetlink errors %lu, psi triggers %lu\n",
+        LD(self_stats.src_hits), LD(self_stats.src_opens), LD(self_stats.src_reopens),
+        LD(self_stats.hwmon_rescans), LD(self_stats.rtnl_errors), LD(self_stats.psi_triggers));
+    OUT("nl80211 errors %lu events %lu\n", LD(self_stats.genl_errors), LD(self_stats.wifi_events));
+    OUT("sway connects %lu failures %lu events %lu, pulse connects %lu failures %lu updates %lu\n",
+        LD(self_stats.sway_connects), LD(self_stats.sway_failures), LD(self_stats.sway_events),
+        LD(self_stats.pa_connects), LD(self_stats.pa_failures), LD(self_stats.pa_updates));
+    double secs[2] = { gov.secs[0], gov.secs[1] };
+    unsigned long wakeups[2] = { gov.wakeups[0], gov.wakeups[1] };
+    secs[gov.factor > 1] += (double)(now_ms() - gov.since_ms) / 1000.0;
+    wakeups[gov.factor > 1] += woken - gov.since_wakeups;
+    OUT("governor %s x%d%s%s: %.0f wakeups/h at the configured rate over %.0fs, %.0f slowed over %.0fs\n",
+        gov.enabled ? "on" : "off", gov.factor, gov.idle ? " idle" : "",
+        LD(batt.on_battery) ? " battery" : "",
+        secs[0] > 0 ? 3600.0 * (double)wakeups[0] / secs[0] : 0.0, secs[0],
+        secs[1] > 0 ? 3600.0 * (double)wakeups[1] / secs[1] : 0.0, secs[1]);
+    OUT("json blocks rebuilt %lu, clicks %lu, config loads %lu, top scans %lu skipped %lu\n",
+        self_stats.blocks_built, self_stats.clicks, LD(self_stats.config_loads),
+        LD(self_stats.top_scans), LD(self_stats.top_skips));
+    OUT("last %d samples min/avg/max: cpu %lld/%lld/%lld%% mem %lld/%lld/%lld%% "
+        "down %lld/%lld/%lld KiB/s up %lld/%lld/%lld KiB/s\n", SERIES_LEN,
+        series_min(&cpu_state.hist), series_avg(&cpu_state.hist), series_max(&cpu_state.hist),
+        series_min(&mem_hist), series_avg(&mem_hist), series_max(&mem_hist),
+        series_min(&net.rx_hist), series_avg(&net.rx_hist), series_max(&net.rx_hist),
+        series_min(&net.tx_hist), series_avg(&net.tx_hist), series_max(&net.tx_hist));
+    OUT("%-6s %8s %6s %6s %9s  latency us: count per bucket\n",
+        "module", "runs", "fail", "late", "max us");
+    for (int i = 0; i < MOD_COUNT; ++i) {
+        if (!modules[i].name) continue;
+        struct mod_stats *st = &modules[i].st;
+        OUT("%-6s %8lu %6lu %6lu %9lld ", modules[i].name, LD(st->runs), LD(st->failures),
+            LD(st->late), LD(st->max_ns) / 1000);
+        for (int b = 0; b < LAT_BUCKETS; ++b) {
+            unsigned long c = LD(st->lat[b]);
+            if (!c) continue;
+            if (b == LAT_BUCKETS - 1) OUT(" >=%ld:%lu", 1L << (b - 1), c);
+            else OUT(" <%ld:%lu", 1L << b, c);
         }
-        pa_operation_unref(op);
+        OUT("\n");
     }
-
-    strncpy(pa_handle.cached_vol, vctx.vol, sizeof(pa_handle.cached_vol) - 1);
-    pa_handle.cached_vol[sizeof(pa_handle.cached_vol) - 1] = '\0';
-    pa_handle.cached_at = time(NULL);
-
-    pa_threaded_mainloop_unlock(pa_handle.ml);
-
-    snprintf(out, outlen, "%4s", pa_handle.cached_vol);
+#undef OUT
+    return off;
 }
 
-/* ---------- Keyboard layout via sway IPC ---------- */
+static void stats_sig_cb(struct watch *w, uint32_t events) {
+    (void)events;
+    struct signalfd_siginfo si;
+    while (read(w->fd, &si, sizeof(si)) == (ssize_t)sizeof(si)) {
+        char buf[4096];
+        size_t n = stats_format(buf, sizeof(buf));
+        write_all(2, buf, n);
+    }
+}
 
-struct sway_ipc_header {
-    char magic[6];
-    uint32_t size;
-    uint32_t type;
-};
+static void stats_accept_cb(struct watch *w, uint32_t events) {
+    (void)events;
+    for (;;) {
+        int fd = accept4(w->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) return;
+        /* the report fits the socket buffer; a client that lets it fill up
+           or has gone already is dropped rather than stalling the reactor */
+        char buf[4096];
+        size_t n = stats_format(buf, sizeof(buf));
+        while (send(fd, buf, n, MSG_NOSIGNAL) < 0 && errno == EINTR) {
+        }
+        close(fd);
+    }
+}
 
-#define I3_IPC_MESSAGE_TYPE_GET_INPUTS 100
+static void stats_cleanup(void) {
+    if (stats_io.path[0]) unlink(stats_io.path);
+}
 
-static int sway_ipc_request(char *buf, size_t buflen) {
-    const char *sock = getenv("SWAYSOCK");
-    if (!sock || !*sock) return -1;
+/* SIGUSR1 must already be blocked in every thread (see main) */
+static void stats_start(void) {
+    stats_io.started_ms = now_ms();
 
-    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
-    if (fd < 0) return -1;
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    stats_io.sig.fd = signalfd(-1, &set, SFD_NONBLOCK | SFD_CLOEXEC);
+    stats_io.sig.on_ready = stats_sig_cb;
+    if (stats_io.sig.fd >= 0) watch_add(&stats_io.sig, EPOLLIN);
 
+    const char *dir = getenv("XDG_RUNTIME_DIR");
+    if (!dir || !*dir) return;
     struct sockaddr_un addr;
     memset(&addr, 0, sizeof(addr));
     addr.sun_family = AF_UNIX;
-    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", sock);
+    if (snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/intellibar.sock", dir) >=
+        (int)sizeof(addr.sun_path))
+        return;
 
-    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    /* a socket someone still answers on belongs to another running bar:
+       leave it alone (SIGUSR1 still works here); only a dead one is replaced */
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return;
+    int live = connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+    int stale = !live && errno == ECONNREFUSED;
+    close(fd);
+    if (live) return;
+    if (stale) unlink(addr.sun_path);       /* left over from a previous run */
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) return;
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 4) < 0) {
         close(fd);
-        return -1;
+        return;
     }
+    snprintf(stats_io.path, sizeof(stats_io.path), "%s", addr.sun_path);
+    atexit(stats_cleanup);
+    stats_io.listen.fd = fd;
+    stats_io.listen.on_ready = stats_accept_cb;
+    watch_add(&stats_io.listen, EPOLLIN);
+}
 
-    unsigned char hdr[14];
-    memcpy(hdr, "i3-ipc", 6);
-    hdr[6] = hdr[7] = hdr[8] = hdr[9] = 0;
-    uint32_t type = I3_IPC_MESSAGE_TYPE_GET_INPUTS;
-    hdr[10] = (unsigned char)(type & 0xff);
-    hdr[11] = (unsigned char)((type >> 8) & 0xff);
-    hdr[12] = (unsigned char)((type >> 16) & 0xff);
-    hdr[13] = (unsigned char)((type >> 24) & 0xff);
-
-    size_t to_write = sizeof(hdr);
-    size_t off = 0;
-    while (to_write > 0) {
-        ssize_t w = write(fd, hdr + off, to_write);
-        if (w < 0) {
-            if (errno == EINTR) continue;
-            close(fd);
-            return -1;
-        }
-        off += (size_t)w;
-        to_write -= (size_t)w;
-    }
+/* ---------- benchmark ---------- */
 
-    unsigned char rh[14];
-    size_t need = sizeof(rh);
-    off = 0;
-    while (need > 0) {
-        ssize_t r = read(fd, rh + off, need);
-        if (r < 0) {
-            if (errno == EINTR) continue;
-            close(fd);
-            return -1;
-        } else if (r == 0) {
-            close(fd);
-            return -1;
-        }
-        off += (size_t)r;
-        need -= (size_t)r;
-    }
+#define BENCH_MAX_ITERS 100000
 
-    if (memcmp(rh, "i3-ipc", 6) != 0) {
-        close(fd);
-        return -1;
-    }
+/* allocation counter for --bench, only in a build with -DINTELLIBAR_BENCH: it
+   wraps malloc for the whole process (libpulse, plugins), so the bar itself
+   keeps the plain allocator. glibc's own entry points stay the allocator */
+#if defined(INTELLIBAR_BENCH) && defined(__GLIBC__)
+static struct {
+    int counting;
+    unsigned long allocs;
+} alloc_stats;
 
-    uint32_t rsize = (uint32_t)rh[6] |
-                     ((uint32_t)rh[7] << 8) |
-                     ((uint32_t)rh[8] << 16) |
-                     ((uint32_t)rh[9] << 24);
+extern "C" void *__libc_malloc(size_t n);
+extern "C" void *__libc_calloc(size_t n, size_t size);
+extern "C" void *__libc_realloc(void *p, size_t n);
 
-    size_t to_read = (size_t)rsize;
-    if (to_read >= buflen) to_read = buflen - 1;
+extern "C" void *malloc(size_t n) noexcept {
+    if (alloc_stats.counting) __atomic_fetch_add(&alloc_stats.allocs, 1, __ATOMIC_RELAXED);
+    return __libc_malloc(n);
+}
 
-    off = 0;
-    while (to_read > 0) {
-        ssize_t r = read(fd, buf + off, to_read);
-        if (r < 0) {
-            if (errno == EINTR) continue;
-            break;
-        } else if (r == 0) break;
-        off += (size_t)r;
-        to_read -= (size_t)r;
-    }
-    buf[off] = '\0';
-    close(fd);
-    return (off > 0) ? 0 : -1;
+extern "C" void *calloc(size_t n, size_t size) noexcept {
+    if (alloc_stats.counting) __atomic_fetch_add(&alloc_stats.allocs, 1, __ATOMIC_RELAXED);
+    return __libc_calloc(n, size);
 }
 
-static void get_kb(char *out, size_t outlen) {
-    static char buf[262144];
-    if (sway_ipc_request(buf, sizeof(buf)) != 0) {
-        snprintf(out, outlen, "??");
-        return;
-    }
+extern "C" void *realloc(void *p, size_t n) noexcept {
+    if (alloc_stats.counting) __atomic_fetch_add(&alloc_stats.allocs, 1, __ATOMIC_RELAXED);
+    return __libc_realloc(p, n);
+}
 
-    const char *key = "\"xkb_active_layout_name\"";
-    const char *p = buf;
-    char best[64] = {0};
+static void bench_alloc_begin(void) {
+    alloc_stats.allocs = 0;
+    alloc_stats.counting = 1;
+}
 
-    while ((p = strstr(p, key)) != NULL) {
-        const char *colon = strchr(p, ':');
-        if (!colon) { p += strlen(key); continue; }
+static double bench_alloc_end(unsigned long calls) {
+    alloc_stats.counting = 0;
+    return (double)alloc_stats.allocs / (double)calls;
+}
+#else
+static void bench_alloc_begin(void) {}
+static double bench_alloc_end(unsigned long calls) { (void)calls; return -1.0; }
+#endif
 
-        const char *val = colon + 1;
-        while (*val == ' ' || *val == '\t' || *val == '\n') val++;
+static long long bench_samples[BENCH_MAX_ITERS];
 
-        if (strncmp(val, "null", 4) == 0) {
-            p = val + 4;
-            continue;
+static int cmp_ll(const void *a, const void *b) {
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+/* with --root, the GET_INPUTS reply is taken from <root>/sway/get_inputs.json
+   and every kb sample re-scans it in SWAY_CHUNK pieces as if read from the
+   socket, so the JSON scan is what gets measured */
+static char bench_kb_json[1 << 20];
+static size_t bench_kb_len;
+
+static int bench_kb(char *out, size_t outlen) {
+    if (bench_kb_len) {
+        sway.type = I3_IPC_MESSAGE_TYPE_GET_INPUTS;
+        kb_scan_begin();
+        for (size_t off = 0; off < bench_kb_len && !sway.scan.done; off += SWAY_CHUNK) {
+            size_t n = bench_kb_len - off < SWAY_CHUNK ? bench_kb_len - off : SWAY_CHUNK;
+            jscan_feed(&sway.scan, bench_kb_json + off, n);
         }
+        kb_scan_end();
+    }
+    return get_kb(out, outlen);
+}
 
-        if (*val != '"') { p = val + 1; continue; }
-        val++;
-        const char *end = strchr(val, '"');
-        if (!end) { p = val; continue; }
+/* the reactor's part of a tick in which every field changed: take each
+   collector's result from its handoff slot, publish it and write the line
+   (to /dev/null), which is all text handling after the collectors */
+static int bench_line(char *out, size_t outlen) {
+    for (int i = 0; i < MOD_PLUGIN; ++i) {
+        struct module *m = &modules[i];
+        char buf[sizeof(m->good)];
+        int rc;
+        pub_read(&m->result, &rc, buf, sizeof(buf));
+        m->text[0] = '\0';
+        module_publish(m, rc, buf);
+    }
+    flush_line();
+    snprintf(out, outlen, "%d fields", layout.count);
+    return 0;
+}
 
-        size_t len = (size_t)(end - val);
-        if (len == 0) { p = end + 1; continue; }
-        if (len >= sizeof(best)) len = sizeof(best) - 1;
+static void bench_one(const char *name, int (*fn)(char *, size_t), int iters) {
+    char out[FIELD_LEN];
+    fn(out, sizeof(out));                   /* warm up: discovery, baselines, open fds */
 
-        memcpy(best, val, len);
-        best[len] = '\0';
-        break;
+    __atomic_store_n(&io_stats.syscalls, 0, __ATOMIC_RELAXED);
+    bench_alloc_begin();
+    for (int i = 0; i < iters; ++i) {
+        long long t0 = now_ns();
+        fn(out, sizeof(out));
+        bench_samples[i] = now_ns() - t0;
     }
+    double allocs = bench_alloc_end((unsigned long)iters);
+    double syscalls = (double)__atomic_exchange_n(&io_stats.syscalls, 0, __ATOMIC_RELAXED) / iters;
 
-    if (best[0] == '\0') {
-        snprintf(out, outlen, "??");
-        return;
+    qsort(bench_samples, (size_t)iters, sizeof(bench_samples[0]), cmp_ll);
+    long long p50 = bench_samples[iters / 2];
+    long long p99 = bench_samples[(int)((long long)iters * 99 / 100)];
+    char per_call[16] = "       -";           /* not counted in this build */
+    if (allocs >= 0) snprintf(per_call, sizeof(per_call), "%8.2f", allocs);
+    printf("%-6s %8d %10.2f %10.2f %10.2f %s   %s\n", name, iters,
+           (double)p50 / 1000.0, (double)p99 / 1000.0, syscalls, per_call, out);
+}
+
+/* every collector in isolation on the calling thread; no reactor, workers,
+   sway or PulseAudio connection is started */
+static int run_bench(int iters) {
+    if (iters < 1) iters = 1;
+    if (iters > BENCH_MAX_ITERS) iters = BENCH_MAX_ITERS;
+
+    if (sys_root[0]) {
+        struct source src = SOURCE("/sway/get_inputs.json");
+        ssize_t n = source_read(&src, bench_kb_json, sizeof(bench_kb_json));
+        bench_kb_len = n > 0 ? (size_t)n : 0;
+        source_close(&src);
     }
 
-    if (strstr(best, "UK") || strstr(best, "United Kingdom") || strstr(best, "British")) {
-        snprintf(out, outlen, "UK");
-        return;
+    printf("%-6s %8s %10s %10s %10s %8s   %s\n",
+           "module", "calls", "p50 us", "p99 us", "syscalls", "allocs", "last output");
+    for (int i = 0; i < MOD_PLUGIN; ++i) {
+        if (i == MOD_KB) bench_one(modules[i].name, bench_kb, iters);
+        else if (i == MOD_TOP) bench_one(modules[i].name, get_top_now, iters);     /* full scans, no budget */
+        else bench_one(modules[i].name, modules[i].collect, iters);
     }
-    if (strstr(best, "Romanian")) {
-        snprintf(out, outlen, "RO");
-        return;
+
+    /* the default layout fed with one more sample of every collector */
+    struct settings st;
+    settings_defaults(&st);
+    layout_compile(&st);
+    clock_format();
+    for (int i = 0; i < MOD_PLUGIN; ++i) {
+        char buf[FIELD_LEN];
+        int rc = i == MOD_KB ? bench_kb(buf, sizeof(buf)) : modules[i].collect(buf, sizeof(buf));
+        pub_write(&modules[i].result, rc, buf);
     }
+    output.fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    bench_one(output.json ? "json" : "line", bench_line, iters);
+    return 0;
+}
 
-    char s[3] = {'?', '?', '\0'};
-    if (best[0]) s[0] = (best[0] >= 'a' && best[0] <= 'z') ? (char)(best[0] - 32) : best[0];
-    if (best[1]) s[1] = (best[1] >= 'a' && best[1] <= 'z') ? (char)(best[1] - 32) : best[1];
+/* ---------- replay ---------- */
 
-    snprintf(out, outlen, "%s", s);
-}
+/* single-threaded, nothing but the tape: each run's frame is handed to its
+   collector, the result published and the line written to stdout. Runs whose
+   text, level or inputs differ from the recording are reported */
+static int run_replay(const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat sb;
+    if (fd < 0 || fstat(fd, &sb) < 0) {
+        perror("intellibar: replay");
+        return 1;
+    }
+    size_t size = (size_t)sb.st_size, off = sizeof(TAPE_MAGIC) - 1;
+    const char *base = size ? (const char *)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+    close(fd);
+    if (!base || base == MAP_FAILED || size < off || memcmp(base, TAPE_MAGIC, off) != 0) {
+        fprintf(stderr, "intellibar: replay: %s is not a recording\n", path);
+        return 1;
+    }
 
-/* ---------- stats thread ---------- */
+    tape.replay = 1;
+    settings_defaults(&config.defaults);
+    config_apply(&config.defaults);
 
-static void *gather_stats_loop(void *) {
-    char mem[32], cpu[16], temp[16], disk[32], net[64], audio[16], kb[8], batt[32];
+    unsigned long runs = 0, mismatched = 0;
+    long long t0 = now_ns();
+    struct tape_rec r;
+    for (; off + sizeof(r) <= size; off += sizeof(r) + r.len) {
+        memcpy(&r, base + off, sizeof(r));
+        const char *p = base + off + sizeof(r);
+        if (r.len > size - off - sizeof(r)) break;      /* cut short by the recorder's exit */
+        size_t tlen = strnlen(p, r.len);
+        if ((r.kind == TAPE_RUN || r.kind == TAPE_CONFIG) && tlen >= r.len) break;
 
-    while (1) {
-        get_mem(mem, sizeof(mem));
-        get_cpu_usage(cpu, sizeof(cpu));
-        get_temp(temp, sizeof(temp));
-        get_disk(disk, sizeof(disk));
-        get_net_speed(net, sizeof(net));
-        get_audio(audio, sizeof(audio));
-        get_kb(kb, sizeof(kb));
-        get_battery(batt, sizeof(batt));
-
-        char line[512];
-        snprintf(line, sizeof(line),
-                 "| RAM: %s | CPU: %s | Temp: %s | Disk: %s | %s | Vol: %s | 🖮  %s | ↯ %s",
-                 mem, cpu, temp, disk, net, audio, kb, batt);
-
-        pthread_mutex_lock(&shared_data.mtx);
-        strncpy(shared_data.line, line, sizeof(shared_data.line) - 1);
-        shared_data.line[sizeof(shared_data.line) - 1] = '\0';
-        pthread_mutex_unlock(&shared_data.mtx);
-
-        sleep(STATS_INTERVAL);
+        if (r.kind == TAPE_SWAY) {
+            int complete;
+            if (!r.len) sway_reset();
+            else if (sway_consume(p, r.len, &complete) > 0 && complete) kb_scan_end();
+        } else if (r.kind == TAPE_CONFIG) {
+            struct settings st = config.defaults;
+            char text[8192];
+            str_copy(text, sizeof(text), p);
+            settings_parse(&st, text);
+            config_apply(&st);
+        } else if (r.kind == TAPE_CLOCK) {
+            time_t t;
+            memcpy(&t, p, sizeof(t));
+            clock_format_at(t);
+            clock_field.text_gen = ++loop.gen;
+        } else if (r.kind == TAPE_RUN && r.module < MOD_COUNT) {
+            struct module *m = &modules[r.module];
+            char buf[FIELD_LEN];
+            int rc = r.rc;
+            if (tape_text_only(r.module)) {
+                str_copy(buf, sizeof(buf), p);
+            } else {
+                struct tape_frame f = { (char *)p + tlen + 1, r.len - tlen - 1, 0, 0 };
+                tape_cur = &f;
+                rc = m->collect(buf, sizeof(buf));
+                tape_cur = NULL;
+                runs++;
+                if (rc != r.rc || strcmp(buf, p) != 0 || f.bad || f.pos != f.len) {
+                    if (mismatched++ < 5)
+                        fprintf(stderr, "intellibar: replay: %s at offset %zu gave \"%s\" (%d), recorded \"%s\" (%d)%s\n",
+                                m->name, off, buf, rc, p, r.rc, f.bad || f.pos != f.len ? ", inputs differ" : "");
+                }
+            }
+            module_publish(m, rc, buf);
+        }
+        flush_line();
     }
-    return NULL;
+
+    double secs = (double)(now_ns() - t0) / 1e9;
+    if (secs <= 0) secs = 1e-9;
+    fprintf(stderr, "intellibar: replayed %lu runs, %lu lines in %.3f s (%.0f runs/s, %.0f lines/s), %lu mismatched\n",
+            runs, self_stats.lines, secs, (double)runs / secs, (double)self_stats.lines / secs, mismatched);
+    return mismatched ? 1 : 0;
 }
 
 /* ---------- main loop ---------- */
 
-int main() {
-    pthread_mutex_init(&shared_data.mtx, NULL);
-    shared_data.line[0] = '\0';
+static int usage(const char *argv0) {
+    fprintf(stderr, "usage: %s [--json] [--config FILE] [--trace] [--bench [N]] [--root DIR]\n"
+            "       [--record FILE | --replay FILE] [--plugin FILE]...\n", argv0);
+    return 2;
+}
 
-    pthread_t th;
-    pthread_create(&th, NULL, gather_stats_loop, NULL);
-    pthread_detach(th);
+int main(int argc, char **argv) {
+    int bench = 0;
+    const char *replay = NULL;
+    const char *plugin_path[PLUGIN_MAX];
+    int plugin_paths = 0;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--trace") == 0) {
+            io_stats.trace = 1;
+        } else if (strcmp(argv[i], "--bench") == 0) {
+            bench = 1000;
+            if (i + 1 < argc && argv[i + 1][0] != '-') {
+                char *end;
+                long n = strtol(argv[++i], &end, 10);
+                if (*end || n < 1) return usage(argv[0]);
+                bench = n > BENCH_MAX_ITERS ? BENCH_MAX_ITERS : (int)n;
+            }
+        } else if (strcmp(argv[i], "--root") == 0 && i + 1 < argc) {
+            sys_root = argv[++i];
+        } else if (strcmp(argv[i], "--json") == 0) {
+            output.json = 1;
+        } else if (strcmp(argv[i], "--config") == 0 && i + 1 < argc) {
+            snprintf(config.path, sizeof(config.path), "%s", argv[++i]);
+        } else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+            tape.fd = open(argv[++i], O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            if (tape.fd < 0) {
+                perror("intellibar: record");
+                return 1;
+            }
+            write_all(tape.fd, TAPE_MAGIC, sizeof(TAPE_MAGIC) - 1);
+        } else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+            replay = argv[++i];
+        } else if (strcmp(argv[i], "--plugin") == 0 && i + 1 < argc && plugin_paths < PLUGIN_MAX) {
+            plugin_path[plugin_paths++] = argv[++i];
+        } else {
+            return usage(argv[0]);
+        }
+    }
+    if (bench) return run_bench(bench);
+    if (replay) return run_replay(replay);
 
-    while (1) {
-        struct timespec ts;
-        clock_gettime(CLOCK_REALTIME, &ts);
-        ts.tv_sec += 1;
-        ts.tv_nsec = 0;
-        clock_nanosleep(CLOCK_REALTIME, TIMER_ABSTIME, &ts, NULL);
+    /* block before any thread (workers, PulseAudio) exists so SIGUSR1 only
+       reaches the signalfd */
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
 
-        char line[512];
-        pthread_mutex_lock(&shared_data.mtx);
-        strncpy(line, shared_data.line, sizeof(line) - 1);
-        line[sizeof(line) - 1] = '\0';
-        pthread_mutex_unlock(&shared_data.mtx);
+    loop.epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop.epfd < 0) {
+        perror("intellibar: epoll_create1");
+        return 1;
+    }
+    for (int i = 0; i < plugin_paths; ++i)
+        if (plugin_load(plugin_path[i]) < 0) return 1;
 
-        if (line[0] == '\0') continue;
+    config_start();
+    if (clock_start() < 0 || modules_start() < 0) {
+        perror("intellibar: timerfd");
+        return 1;
+    }
+    gov_start();
+    stats_start();
+    uevent_start();
+    rtnl_events_start();
+    wifi_events_start();
+    mounts_start();
+    sway_start();
+    audio_start();
+    if (output.json) json_start();
+    flush_line();
 
-        time_t now = time(NULL);
-        struct tm tm;
-        localtime_r(&now, &tm);
-        char date_buf[64];
-        strftime(date_buf, sizeof(date_buf), "%a, %e %b, %H:%M", &tm);
+    struct epoll_event evs[16];
+    while (1) {
+        int n = epoll_wait(loop.epfd, evs, 16, -1);
+        count_syscalls(1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("intellibar: epoll_wait");
+            return 1;
+        }
+        for (int i = 0; i < n; ++i) {
+            struct watch *w = (struct watch *)evs[i].data.ptr;
+            w->on_ready(w, evs[i].events);
+        }
+        flush_line();
 
-        char out[640];
-        int n = snprintf(out, sizeof(out), "%s | %s\n", line, date_buf);
-        if (n > 0) write(1, out, (size_t)n);
+        io_stats.ticks++;
+        unsigned long sc = __atomic_exchange_n(&io_stats.syscalls, 0, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&self_stats.syscalls_total, sc, __ATOMIC_RELAXED);
+        if (io_stats.trace) fprintf(stderr, "intellibar: tick %lu: %lu syscalls\n", io_stats.ticks, sc);
     }
 
     return 0;
 }
-